@@ -15,6 +15,7 @@
 #include <type_traits>
 #include <unordered_map>
 #include <unordered_set>
+#include <utility>
 #include <vector>
 
 namespace ParallelTools {
@@ -144,6 +145,31 @@ public:
     });
     return entries;
   }
+  // like unlocked_entries, but the keys and values are moved out instead of
+  // copied and each map is freed as soon as it has been drained, so the
+  // entries are only held once.  The map is left empty.
+  // the output uses default_init_allocator, so for trivially copyable keys
+  // and values it is not zeroed before the entries are moved in
+  using entries_type = std::vector<std::pair<Key, T>,
+                                   default_init_allocator<std::pair<Key, T>>>;
+  entries_type take_entries() {
+    std::vector<size_t> offsets(maps.size() + 1, 0);
+    for (size_t i = 0; i < maps.size(); i++) {
+      offsets[i + 1] = offsets[i] + maps[i].m.first.size();
+    }
+    entries_type entries(offsets.back());
+    ParallelTools::parallel_for(
+        0, maps.size(),
+        [&](size_t i) {
+          size_t j = offsets[i];
+          for (auto &entry : maps[i].m.first) {
+            entries[j++] = std::move(entry);
+          }
+          ska::flat_hash_map<Key, T, Hash, KeyEqual>().swap(maps[i].m.first);
+        },
+        1);
+    return entries;
+  }
 
   void clear() { maps.clear(); }
 };
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace ParallelTools {
+
+// an allocator which default initializes instead of value initializing, so
+// resizing a vector of trivial types does not write to the new elements
+// types which are trivially copyable and destructible, like a std::pair of
+// integers, are not constructed at all and the new elements hold whatever was
+// in memory until they are assigned to
+template <class T, class A = std::allocator<T>>
+class default_init_allocator : public A {
+  using traits = std::allocator_traits<A>;
+
+public:
+  template <class U> struct rebind {
+    using other =
+        default_init_allocator<U, typename traits::template rebind_alloc<U>>;
+  };
+
+  using A::A;
+
+  template <class U>
+  void construct(U *ptr) noexcept(
+      std::is_nothrow_default_constructible_v<U>) {
+    if constexpr (!std::is_trivially_copyable_v<U> ||
+                  !std::is_trivially_destructible_v<U>) {
+      ::new (static_cast<void *>(ptr)) U;
+    }
+  }
+  template <class U, class... Args> void construct(U *ptr, Args &&...args) {
+    traits::construct(static_cast<A &>(*this), ptr,
+                      std::forward<Args>(args)...);
+  }
+};
+
+} // namespace ParallelTools
@@ -0,0 +1,275 @@
+#pragma once
+
+#include "parallel.h"
+#include "sort.hpp"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <fcntl.h>
+#include <functional>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <type_traits>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+namespace ParallelTools {
+
+namespace detail {
+
+// closes the file when it goes out of scope
+class file_descriptor {
+  int fd_;
+
+public:
+  explicit file_descriptor(int fd) : fd_(fd) {}
+  ~file_descriptor() {
+    if (fd_ >= 0) {
+      close(fd_);
+    }
+  }
+  file_descriptor(const file_descriptor &) = delete;
+  file_descriptor &operator=(const file_descriptor &) = delete;
+
+  [[nodiscard]] int get() const { return fd_; }
+  [[nodiscard]] bool valid() const { return fd_ >= 0; }
+};
+
+// pread and write can both stop short, these loop until everything is done
+inline bool read_all(int fd, void *buf, size_t bytes, size_t offset) {
+  auto *p = static_cast<char *>(buf);
+  while (bytes > 0) {
+    ssize_t r = pread(fd, p, bytes, static_cast<off_t>(offset));
+    if (r <= 0) {
+      return false;
+    }
+    p += r;
+    bytes -= r;
+    offset += r;
+  }
+  return true;
+}
+
+inline bool write_all(int fd, const void *buf, size_t bytes) {
+  const auto *p = static_cast<const char *>(buf);
+  while (bytes > 0) {
+    ssize_t r = write(fd, p, bytes);
+    if (r <= 0) {
+      return false;
+    }
+    p += r;
+    bytes -= r;
+  }
+  return true;
+}
+
+// a read only mapping of a whole file
+class mapped_file {
+  void *data_ = MAP_FAILED;
+  size_t bytes_ = 0;
+
+public:
+  mapped_file(int fd, size_t bytes) : bytes_(bytes) {
+    if (bytes_ > 0) {
+      data_ = mmap(nullptr, bytes_, PROT_READ, MAP_SHARED, fd, 0);
+    }
+  }
+  ~mapped_file() {
+    if (data_ != MAP_FAILED) {
+      munmap(data_, bytes_);
+    }
+  }
+  mapped_file(const mapped_file &) = delete;
+  mapped_file &operator=(const mapped_file &) = delete;
+
+  [[nodiscard]] bool valid() const { return data_ != MAP_FAILED; }
+  [[nodiscard]] const char *data() const {
+    return static_cast<const char *>(data_);
+  }
+  [[nodiscard]] size_t size() const { return bytes_; }
+
+  // advice over [start, end), widened or narrowed to whole pages
+  void advise(size_t start, size_t end, int advice, bool whole_pages_only) {
+    static const size_t page = sysconf(_SC_PAGESIZE);
+    end = std::min(end, bytes_);
+    if (whole_pages_only) {
+      start = (start + page - 1) / page * page;
+      end = end / page * page;
+    } else {
+      start = start / page * page;
+    }
+    if (start < end) {
+      madvise(const_cast<char *>(data()) + start, end - start, advice);
+    }
+  }
+};
+
+// sorts the n elements of fd_in into fd_out, see external_sort
+template <class T, class Compare>
+bool external_sort_fds(int fd_in, int fd_out, size_t n,
+                       const std::string &path_runs, size_t memory_budget,
+                       Compare comp) {
+  // sort needs a scratch buffer the same size as its input, and sample_sort
+  // also keeps a uint16_t bucket for each element
+  size_t run_size = std::max<size_t>(
+      memory_budget / (2 * sizeof(T) + sizeof(uint16_t)), 1);
+
+  if (n <= run_size) {
+    sort_buffer<T> buffer(n);
+    if (!read_all(fd_in, buffer.data(), n * sizeof(T), 0)) {
+      return false;
+    }
+    ParallelTools::sort(buffer.data(), buffer.data() + n, comp);
+    return write_all(fd_out, buffer.data(), n * sizeof(T));
+  }
+
+  file_descriptor fd_runs(
+      open(path_runs.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600));
+  if (!fd_runs.valid()) {
+    return false;
+  }
+  // the runs are only reachable through the descriptor from here on, so they
+  // go away however this returns
+  unlink(path_runs.c_str());
+
+  size_t num_runs = (n + run_size - 1) / run_size;
+  {
+    sort_buffer<T> buffer(run_size);
+    for (size_t i = 0; i < num_runs; i++) {
+      size_t start = i * run_size;
+      size_t count = std::min(run_size, n - start);
+      if (!read_all(fd_in, buffer.data(), count * sizeof(T),
+                    start * sizeof(T))) {
+        return false;
+      }
+      ParallelTools::sort(buffer.data(), buffer.data() + count, comp);
+      if (!write_all(fd_runs.get(), buffer.data(), count * sizeof(T))) {
+        return false;
+      }
+    }
+  }
+
+  mapped_file runs_map(fd_runs.get(), n * sizeof(T));
+  if (!runs_map.valid()) {
+    return false;
+  }
+  runs_map.advise(0, runs_map.size(), MADV_SEQUENTIAL, false);
+  const T *base = reinterpret_cast<const T *>(runs_map.data());
+  std::vector<std::pair<const T *, const T *>> runs(num_runs);
+  for (size_t i = 0; i < num_runs; i++) {
+    runs[i] = {base + i * run_size, base + std::min((i + 1) * run_size, n)};
+  }
+
+  // two output buffers so one batch is written while the next is merged, the
+  // buffers together with the batch being read from the mapping fit the
+  // budget
+  size_t batch_size = std::max<size_t>(memory_budget / (4 * sizeof(T)), 1);
+  sort_buffer<T> buffers(2 * batch_size);
+  size_t readahead = std::max<size_t>(batch_size / num_runs, 1) * sizeof(T);
+  size_t remaining = n;
+  size_t pending = 0;
+  size_t current = 0;
+  while (remaining > 0 || pending > 0) {
+    size_t count = std::min(batch_size, remaining);
+    T *out = buffers.data() + current * batch_size;
+    const T *prev = buffers.data() + (1 - current) * batch_size;
+    bool write_ok = true;
+    ParallelTools::par_do(
+        [&]() {
+          if (pending > 0) {
+            write_ok = write_all(fd_out, prev, pending * sizeof(T));
+          }
+        },
+        [&]() {
+          if (count == 0) {
+            return;
+          }
+          std::vector<size_t> split =
+              ParallelTools::co_rank(runs, count, comp);
+          std::vector<std::pair<const T *, const T *>> pieces(num_runs);
+          for (size_t i = 0; i < num_runs; i++) {
+            pieces[i] = {runs[i].first, runs[i].first + split[i]};
+          }
+          ParallelTools::multiway_merge(pieces, out, comp);
+          for (size_t i = 0; i < num_runs; i++) {
+            if (split[i] == 0) {
+              continue;
+            }
+            size_t from = reinterpret_cast<const char *>(runs[i].first) -
+                          runs_map.data();
+            runs[i].first += split[i];
+            size_t to = reinterpret_cast<const char *>(runs[i].first) -
+                        runs_map.data();
+            size_t run_end = reinterpret_cast<const char *>(runs[i].second) -
+                             runs_map.data();
+            runs_map.advise(from, to, MADV_DONTNEED, true);
+            runs_map.advise(to, std::min(to + readahead, run_end),
+                            MADV_WILLNEED, false);
+          }
+        });
+    if (!write_ok) {
+      return false;
+    }
+    remaining -= count;
+    pending = count;
+    current = 1 - current;
+  }
+  return true;
+}
+
+} // namespace detail
+
+// sorts a file of trivially copyable T which may be larger than memory
+//
+// runs of memory_budget / (2 * sizeof(T) + 2) elements are read, sorted in
+// memory with sort and written one after another to a temporary file next to
+// path_out.  The runs are then merged from a mapping of that file in batches,
+// each batch is split between the runs with co_rank and merged in parallel
+// with multiway_merge while the previous batch is written out.  Pages of the
+// runs are asked for ahead of the merge and dropped once consumed so the
+// resident part of the mapping stays around the size of a batch.
+//
+// the output is written to a temporary file which is renamed over path_out at
+// the end, so path_out may be the same file as path_in and is left untouched
+// if the sort fails
+//
+// returns false if any of the file operations fail or the input is not a
+// whole number of elements
+template <class T, class Compare = std::less<>>
+bool external_sort(const std::string &path_in, const std::string &path_out,
+                   size_t memory_budget, Compare comp = std::less<>()) {
+  static_assert(std::is_trivially_copyable_v<T>,
+                "external_sort reads and writes the raw bytes of elements");
+  detail::file_descriptor fd_in(open(path_in.c_str(), O_RDONLY));
+  if (!fd_in.valid()) {
+    return false;
+  }
+  struct stat st {};
+  if (fstat(fd_in.get(), &st) != 0 ||
+      static_cast<size_t>(st.st_size) % sizeof(T) != 0) {
+    return false;
+  }
+  size_t n = st.st_size / sizeof(T);
+
+  std::string path_tmp = path_out + ".tmp";
+  bool ok = false;
+  {
+    detail::file_descriptor fd_out(
+        open(path_tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644));
+    if (!fd_out.valid()) {
+      return false;
+    }
+    ok = detail::external_sort_fds<T>(fd_in.get(), fd_out.get(), n,
+                                      path_out + ".runs", memory_budget, comp);
+  }
+  if (!ok || rename(path_tmp.c_str(), path_out.c_str()) != 0) {
+    unlink(path_tmp.c_str());
+    return false;
+  }
+  return true;
+}
+
+} // namespace ParallelTools
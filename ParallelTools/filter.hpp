@@ -0,0 +1,268 @@
+#pragma once
+
+#include "default_init_allocator.hpp"
+#include "parallel.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <type_traits>
+#include <vector>
+
+namespace ParallelTools {
+
+namespace detail {
+
+static constexpr size_t pack_min_block_size = 1UL << 11U;
+// filter_inplace moves at most this fraction of the survivors through its
+// buffer at a time
+static constexpr size_t filter_inplace_buffer_fraction = 16;
+
+// calls write(d, i) for every i in [0, n) where keep(i) is true, d counts up
+// from 0 in order of i.  allocate(count) is called with how many will be kept
+// before anything is written.  Returns how many were kept.
+// the range is cut into blocks, each block is counted, the counts are
+// scanned and then each block writes its elements directly to their final
+// position, so keep is called twice for each element
+template <class Keep, class Allocate, class Write>
+size_t pack_blocks(size_t n, const Keep &keep, const Allocate &allocate,
+                   const Write &write) {
+  size_t num_blocks =
+      std::min(n / pack_min_block_size,
+               static_cast<size_t>(ParallelTools::getWorkers()) * 8);
+  if (PARALLEL == 0 || num_blocks == 0) {
+    num_blocks = 1;
+  }
+  std::vector<size_t> offsets(num_blocks + 1, 0);
+  ParallelTools::parallel_for(
+      0, num_blocks,
+      [&](size_t b) {
+        size_t count = 0;
+        for (size_t i = b * n / num_blocks; i < (b + 1) * n / num_blocks;
+             i++) {
+          count += keep(i) ? 1 : 0;
+        }
+        offsets[b + 1] = count;
+      },
+      1);
+  for (size_t b = 0; b < num_blocks; b++) {
+    offsets[b + 1] += offsets[b];
+  }
+  allocate(offsets[num_blocks]);
+  ParallelTools::parallel_for(
+      0, num_blocks,
+      [&](size_t b) {
+        size_t d = offsets[b];
+        for (size_t i = b * n / num_blocks; i < (b + 1) * n / num_blocks;
+             i++) {
+          if (keep(i)) {
+            write(d++, i);
+          }
+        }
+      },
+      1);
+  return offsets[num_blocks];
+}
+
+// pred is evaluated once for each element and saved so that it does not need
+// to be side effect free or cheap
+template <class RandomIt, class UnaryPredicate>
+std::vector<uint8_t> filter_flags(RandomIt first, size_t n,
+                                  UnaryPredicate &pred) {
+  std::vector<uint8_t> flags(n);
+  ParallelTools::parallel_for(0, n,
+                              [&](size_t i) { flags[i] = pred(first[i]); });
+  return flags;
+}
+
+template <class It>
+inline constexpr bool is_random_access_v = std::is_base_of_v<
+    std::random_access_iterator_tag,
+    typename std::iterator_traits<It>::iterator_category>;
+
+template <class T>
+using pack_vector = std::vector<T, default_init_allocator<T>>;
+
+} // namespace detail
+
+// the outputs which are returned as vectors use default_init_allocator, so
+// they are not value initialized before the elements are written in
+
+// the elements of in for which flags is true, in order
+template <class RAC, class Flags>
+auto pack(const RAC &in, const Flags &flags) {
+  detail::pack_vector<
+      std::remove_cv_t<std::remove_reference_t<decltype(in[0])>>>
+      output;
+  detail::pack_blocks(
+      in.size(), [&](size_t i) { return flags[i]; },
+      [&](size_t count) { output.resize(count); },
+      [&](size_t d, size_t i) { output[d] = in[i]; });
+  return output;
+}
+
+// writes the elements of in for which flags is true to d_first and returns
+// the end of the output
+template <class RAC, class Flags, class OutputIt>
+OutputIt pack(const RAC &in, const Flags &flags, OutputIt d_first) {
+  if constexpr (!detail::is_random_access_v<OutputIt>) {
+    for (size_t i = 0; i < in.size(); i++) {
+      if (flags[i]) {
+        *d_first++ = in[i];
+      }
+    }
+    return d_first;
+  } else {
+    return d_first + detail::pack_blocks(
+                         in.size(), [&](size_t i) { return flags[i]; },
+                         [](size_t) {},
+                         [&](size_t d, size_t i) { d_first[d] = in[i]; });
+  }
+}
+
+// the indices where flags is true, in order
+template <class Index = size_t, class Flags>
+detail::pack_vector<Index> pack_index(const Flags &flags) {
+  detail::pack_vector<Index> output;
+  detail::pack_blocks(
+      flags.size(), [&](size_t i) { return flags[i]; },
+      [&](size_t count) { output.resize(count); },
+      [&](size_t d, size_t i) { output[d] = static_cast<Index>(i); });
+  return output;
+}
+
+// the elements of in for which pred is true, in order
+template <class RAC, class UnaryPredicate>
+auto filter(const RAC &in, UnaryPredicate pred) {
+  return ParallelTools::pack(
+      in, detail::filter_flags(in.begin(), in.size(), pred));
+}
+
+// writes the elements of in for which pred is true to d_first and returns
+// the end of the output
+template <class RAC, class OutputIt, class UnaryPredicate>
+OutputIt filter(const RAC &in, OutputIt d_first, UnaryPredicate pred) {
+  if constexpr (!detail::is_random_access_v<OutputIt>) {
+    return std::copy_if(in.begin(), in.end(), d_first, pred);
+  } else {
+    return ParallelTools::pack(
+        in, detail::filter_flags(in.begin(), in.size(), pred), d_first);
+  }
+}
+
+// moves the elements of [first, last) for which pred is true to the front,
+// keeping their order, and returns the new end like std::remove_if does for
+// the ones it keeps
+//
+// each block is first compacted in place, then the survivors are moved down to
+// the offsets from the scan of the block counts.  A survivor's destination can
+// hold a survivor of an earlier block which has not moved yet, so the moves go
+// in windows of destinations: when the gap between the window and the first
+// survivor still to be read is large the window is moved directly, otherwise
+// it goes through a buffer which holds a small fraction of the survivors
+template <class RandomIt, class UnaryPredicate>
+RandomIt filter_inplace(RandomIt first, RandomIt last, UnaryPredicate pred) {
+  using T = typename std::iterator_traits<RandomIt>::value_type;
+  size_t n = last - first;
+  std::vector<uint8_t> flags = detail::filter_flags(first, n, pred);
+  auto compact = [&](size_t start, size_t end) {
+    size_t out = start;
+    for (size_t i = start; i < end; i++) {
+      if (flags[i]) {
+        if (out != i) {
+          first[out] = std::move(first[i]);
+        }
+        out++;
+      }
+    }
+    return out - start;
+  };
+  if (PARALLEL == 0 || n < 2 * detail::pack_min_block_size) {
+    return first + compact(0, n);
+  }
+  size_t num_blocks =
+      std::min(n / detail::pack_min_block_size,
+               static_cast<size_t>(ParallelTools::getWorkers()) * 8);
+  std::vector<size_t> offsets(num_blocks + 1, 0);
+  ParallelTools::parallel_for(
+      0, num_blocks,
+      [&](size_t b) {
+        offsets[b + 1] = compact(b * n / num_blocks, (b + 1) * n / num_blocks);
+      },
+      1);
+  for (size_t b = 0; b < num_blocks; b++) {
+    offsets[b + 1] += offsets[b];
+  }
+  size_t kept = offsets[num_blocks];
+  // the survivors of block b now start at b * n / num_blocks and go to
+  // [offsets[b], offsets[b + 1])
+  auto source = [&](size_t b, size_t d) {
+    return b * n / num_blocks + (d - offsets[b]);
+  };
+  // calls f(d, s) in parallel for each destination d in [lo, hi) and the
+  // position s of the survivor which goes there
+  auto for_window = [&](size_t lo, size_t hi, auto f) {
+    size_t num_chunks = std::max((hi - lo) / detail::pack_min_block_size,
+                                 size_t{1});
+    ParallelTools::parallel_for(
+        0, num_chunks,
+        [&](size_t c) {
+          size_t d = lo + c * (hi - lo) / num_chunks;
+          size_t end = lo + (c + 1) * (hi - lo) / num_chunks;
+          size_t b = std::upper_bound(offsets.begin(), offsets.end(), d) -
+                     offsets.begin() - 1;
+          for (; d < end; d++) {
+            while (d >= offsets[b + 1]) {
+              b++;
+            }
+            f(d, source(b, d));
+          }
+        },
+        1);
+  };
+  // the survivors of the leading blocks which had nothing removed are in place
+  size_t b = 0;
+  while (b < num_blocks && offsets[b + 1] == (b + 1) * n / num_blocks) {
+    b++;
+  }
+  size_t d = offsets[b];
+  size_t buffer_size =
+      std::max(kept / detail::filter_inplace_buffer_fraction,
+               detail::pack_min_block_size);
+  detail::pack_vector<T> buffer;
+  while (d < kept) {
+    while (d >= offsets[b + 1]) {
+      b++;
+    }
+    // every survivor not read yet is at or after the one going to d
+    size_t gap = source(b, d) - d;
+    if (gap >= buffer_size) {
+      size_t end = std::min(d + gap, kept);
+      for_window(d, end, [&](size_t to, size_t from) {
+        first[to] = std::move(first[from]);
+      });
+      d = end;
+    } else {
+      size_t end = std::min(d + buffer_size, kept);
+      if (buffer.size() < end - d) {
+        buffer.resize(end - d);
+      }
+      for_window(d, end, [&](size_t to, size_t from) {
+        buffer[to - d] = std::move(first[from]);
+      });
+      ParallelTools::parallel_for(0, end - d, [&](size_t i) {
+        first[d + i] = std::move(buffer[i]);
+      });
+      d = end;
+    }
+  }
+  return first + kept;
+}
+
+template <class T, class UnaryPredicate>
+void filter_inplace(std::vector<T> &in, UnaryPredicate pred) {
+  in.erase(ParallelTools::filter_inplace(in.begin(), in.end(), pred),
+           in.end());
+}
+
+} // namespace ParallelTools
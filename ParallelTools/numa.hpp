@@ -0,0 +1,261 @@
+#pragma once
+
+// numa helpers
+//
+// the topology comes from libnuma when NUMA == 1 (link with -lnuma) and from
+// /sys/devices/system/node otherwise, when neither is available there is a
+// single node and everything here still works, it just does nothing special
+//
+// which node a worker is on is only stable if the workers are pinned to cpus,
+// for example with taskset, numactl or OMP_PROC_BIND
+
+#include "parallel.h"
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <fstream>
+#include <new>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#if defined(__linux__)
+#include <sched.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#if NUMA == 1
+#include <numa.h>
+#endif
+
+namespace ParallelTools {
+
+namespace detail {
+
+// parses lists like "0-3,8,10-11"
+inline std::vector<int> parse_cpu_list(const std::string &list) {
+  std::vector<int> values;
+  size_t pos = 0;
+  while (pos < list.size()) {
+    size_t end = list.find(',', pos);
+    if (end == std::string::npos) {
+      end = list.size();
+    }
+    std::string item = list.substr(pos, end - pos);
+    size_t dash = item.find('-');
+    if (!item.empty() && item[0] >= '0' && item[0] <= '9') {
+      int first = std::atoi(item.c_str());
+      int last = first;
+      if (dash != std::string::npos) {
+        last = std::atoi(item.c_str() + dash + 1);
+      }
+      for (int i = first; i <= last; i++) {
+        values.push_back(i);
+      }
+    }
+    pos = end + 1;
+  }
+  return values;
+}
+
+struct numa_topology {
+  int num_nodes = 1;
+  // the node of each cpu, cpus not in the list are on node 0
+  std::vector<int> node_of_cpu;
+
+  numa_topology() {
+#if NUMA == 1
+    if (numa_available() >= 0) {
+      num_nodes = numa_num_configured_nodes();
+      int cpus = numa_num_configured_cpus();
+      node_of_cpu.resize(cpus, 0);
+      for (int cpu = 0; cpu < cpus; cpu++) {
+        int node = numa_node_of_cpu(cpu);
+        node_of_cpu[cpu] = (node < 0) ? 0 : node;
+      }
+    }
+#elif defined(__linux__)
+    std::ifstream online_file("/sys/devices/system/node/online");
+    std::string online;
+    if (!(online_file >> online)) {
+      return;
+    }
+    std::vector<int> nodes = parse_cpu_list(online);
+    if (nodes.empty()) {
+      return;
+    }
+    num_nodes = nodes.back() + 1;
+    for (int node : nodes) {
+      std::ifstream cpu_file("/sys/devices/system/node/node" +
+                             std::to_string(node) + "/cpulist");
+      std::string cpu_list;
+      if (!(cpu_file >> cpu_list)) {
+        continue;
+      }
+      for (int cpu : parse_cpu_list(cpu_list)) {
+        if (static_cast<size_t>(cpu) >= node_of_cpu.size()) {
+          node_of_cpu.resize(cpu + 1, 0);
+        }
+        node_of_cpu[cpu] = node;
+      }
+    }
+#endif
+    if (num_nodes < 1) {
+      num_nodes = 1;
+    }
+  }
+};
+
+inline const numa_topology &get_numa_topology() {
+  static numa_topology topology;
+  return topology;
+}
+
+inline size_t numa_page_size() {
+#if defined(__linux__)
+  static const size_t page = sysconf(_SC_PAGESIZE);
+  return page;
+#else
+  return 4096;
+#endif
+}
+
+// splits [start, end) into getWorkers() equal blocks and calls
+// f(block_start, block_end) on each one in parallel.
+// with OpenMP outside of a parallel region the blocks are scheduled
+// statically so thread i always runs block i.  The work stealing backends
+// can't bind a task to a worker, so there placement is best effort: a block
+// is run by the worker whose number matches it whenever that worker picks up
+// one of the tasks, but a worker which is busy elsewhere has its block taken
+// by whoever gets to it first
+template <typename F>
+inline void static_blocks(size_t start, size_t end, const F &f) {
+  size_t n = end - start;
+  size_t num_blocks = static_cast<size_t>(getWorkers());
+  if (PARALLEL == 0 || num_blocks == 1) {
+    f(start, end);
+    return;
+  }
+#if OPENMP == 1
+  if (!omp_in_parallel()) {
+#pragma omp parallel for schedule(static, 1) num_threads(num_blocks)
+    for (size_t block = 0; block < num_blocks; block++) {
+      f(start + block * n / num_blocks, start + (block + 1) * n / num_blocks);
+    }
+    return;
+  }
+#endif
+  std::vector<std::atomic<bool>> claimed(num_blocks);
+  for (auto &c : claimed) {
+    c.store(false, std::memory_order_relaxed);
+  }
+  ParallelTools::parallel_for(
+      0, num_blocks,
+      [&](size_t) {
+        size_t block = static_cast<size_t>(getWorkerNum());
+        if (block >= num_blocks ||
+            claimed[block].exchange(true, std::memory_order_relaxed)) {
+          // there are as many tasks as blocks so one is always left
+          for (block = 0; block < num_blocks; block++) {
+            if (!claimed[block].exchange(true, std::memory_order_relaxed)) {
+              break;
+            }
+          }
+        }
+        f(start + block * n / num_blocks, start + (block + 1) * n / num_blocks);
+      },
+      1);
+}
+
+} // namespace detail
+
+[[maybe_unused]] static int getNumaNodes() {
+  return detail::get_numa_topology().num_nodes;
+}
+
+// the node of the cpu the calling worker is running on right now
+[[maybe_unused]] static int getNumaNode() {
+#if defined(__linux__)
+  int cpu = sched_getcpu();
+  const auto &node_of_cpu = detail::get_numa_topology().node_of_cpu;
+  if (cpu >= 0 && static_cast<size_t>(cpu) < node_of_cpu.size()) {
+    return node_of_cpu[cpu];
+  }
+#endif
+  return 0;
+}
+
+// a parallel_for with a fixed partition, worker w runs the w'th of
+// getWorkers() equal blocks of the range whenever it can.  Passes which use
+// the same partition over the same data will find it on the same node.
+template <typename F>
+inline void parallel_for_static(size_t start, size_t end, F f) {
+  if (end <= start) {
+    return;
+  }
+  detail::static_blocks(start, end, [&](size_t block_start, size_t block_end) {
+    for (size_t i = block_start; i < block_end; i++) {
+      f(i);
+    }
+  });
+}
+
+// an array of n value initialized elements whose pages are first touched with
+// the parallel_for_static partition, so each block of the array is placed on
+// the node of the worker which will handle it in parallel_for_static
+// returns nullptr if the allocation fails, free it with numa_free_array
+template <class T> T *numa_allocate_array(size_t n) {
+  if (n == 0) {
+    return nullptr;
+  }
+  size_t bytes = n * sizeof(T);
+#if defined(__linux__)
+  // fresh anonymous pages are not placed anywhere until they are touched
+  void *mem = mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED) {
+    return nullptr;
+  }
+#else
+  // zeroed like the fresh pages above, since the trivial path below relies on
+  // it
+  void *mem = std::calloc(n, sizeof(T));
+  if (mem == nullptr) {
+    return nullptr;
+  }
+#endif
+  T *array = static_cast<T *>(mem);
+  if constexpr (std::is_trivially_default_constructible_v<T>) {
+    // the pages are already zero so one write to each page is enough
+    char *base = static_cast<char *>(mem);
+    size_t page = detail::numa_page_size();
+    detail::static_blocks(0, n, [&](size_t block_start, size_t block_end) {
+      size_t byte = block_start * sizeof(T);
+      size_t end_byte = block_end * sizeof(T);
+      while (byte < end_byte) {
+        base[byte] = 0;
+        byte = (byte / page + 1) * page;
+      }
+    });
+  } else {
+    parallel_for_static(0, n, [&](size_t i) { new (array + i) T(); });
+  }
+  return array;
+}
+
+template <class T> void numa_free_array(T *array, size_t n) {
+  if (array == nullptr) {
+    return;
+  }
+  if constexpr (!std::is_trivially_destructible_v<T>) {
+    ParallelTools::parallel_for(0, n, [&](size_t i) { array[i].~T(); });
+  }
+#if defined(__linux__)
+  munmap(array, n * sizeof(T));
+#else
+  std::free(array);
+#endif
+}
+
+} // namespace ParallelTools
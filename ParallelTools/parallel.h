@@ -1,6 +1,13 @@
 #pragma once
+#include <atomic>
+#include <chrono>
 #include <cstddef>
 #include <cstdlib>
+#include <functional>
+#include <mutex>
+#include <tuple>
+#include <utility>
+#include <vector>
 
 #if CILK == 1
 #define PARALLEL 1
@@ -15,6 +22,18 @@
 #pragma clang diagnostic ignored "-Wshadow"
 #include "parlay/parallel.h"
 #pragma clang diagnostic pop
+#include <utility>
+#include <vector>
+#endif
+
+#if OPENMP == 1
+#define PARALLEL 1
+#include <omp.h>
+#endif
+
+#if PT_THREADS == 1
+#define PARALLEL 1
+#include "thread_scheduler.hpp"
 #endif
 
 #if !defined(PARALLEL)
@@ -174,6 +193,62 @@ inline void parallel_for_each(RAC &container, F f, const size_t chunksize = 0) {
       0, container.size(), [&](size_t i) { f(container[i]); }, chunksize);
 }
 
+namespace detail {
+// how deep parallel_for_each_spawn recurses before it switches to expanding
+// one level at a time
+static constexpr size_t spawn_max_depth = 64;
+
+// expands every element of the frontier, then every element they returned
+// and so on, the stack does not grow with the depth of the expansion
+template <typename F, typename V>
+inline void parallel_for_each_spawn_frontier(V frontier, F &f,
+                                             const size_t chunksize) {
+  while (!frontier.empty()) {
+    std::vector<V> children(frontier.size());
+    parlay::parallel_for(
+        0, frontier.size(), [&](size_t i) { children[i] = f(frontier[i]); },
+        chunksize);
+    std::vector<size_t> offsets(children.size() + 1, 0);
+    for (size_t i = 0; i < children.size(); i++) {
+      offsets[i + 1] = offsets[i] + children[i].size();
+    }
+    V next(offsets.back());
+    parlay::parallel_for(0, children.size(), [&](size_t i) {
+      std::move(children[i].begin(), children[i].end(),
+                next.begin() + offsets[i]);
+    });
+    frontier = std::move(next);
+  }
+}
+
+// parlay has no spawn without a join, so the children of an element are
+// expanded inside of the iteration which produced them
+template <typename F, typename RAC>
+inline void parallel_for_each_spawn(RAC &container, F &f,
+                                    const size_t chunksize, size_t depth) {
+  parlay::parallel_for(
+      0, container.size(),
+      [&](size_t i) {
+        auto vec = f(container[i]);
+        if (depth < spawn_max_depth) {
+          parallel_for_each_spawn(vec, f, chunksize, depth + 1);
+        } else {
+          parallel_for_each_spawn_frontier(std::move(vec), f, chunksize);
+        }
+      },
+      chunksize);
+}
+} // namespace detail
+
+// running the function returns a vector
+// each element in the vector is run with the same function as the original
+// vector
+template <typename F, typename RAC>
+inline void parallel_for_each_spawn(RAC &container, F f,
+                                    const size_t chunksize = 0) {
+  detail::parallel_for_each_spawn(container, f, chunksize, 0);
+}
+
 [[maybe_unused]] static int getWorkers() { return parlay::num_workers(); }
 
 [[maybe_unused]] static int getWorkerNum() { return parlay::worker_id(); }
@@ -182,6 +257,195 @@ template <typename Lf, typename Rf> inline void par_do(Lf left, Rf right) {
   parlay::par_do(left, right);
 }
 
+// openmp
+#elif OPENMP == 1
+
+// everything runs as tasks inside of a parallel region, if the caller is not
+// already in one a region is started around f and one thread runs it
+template <typename F> inline void openmp_in_region(F f) {
+  if (omp_in_parallel()) {
+    f();
+  } else {
+#pragma omp parallel
+#pragma omp single
+    f();
+  }
+}
+
+template <typename F> inline void parallel_for(size_t start, size_t end, F f) {
+  if (omp_in_parallel()) {
+#pragma omp taskloop shared(f)
+    for (size_t i = start; i < end; i++) {
+      f(i);
+    }
+  } else {
+#pragma omp parallel for
+    for (size_t i = start; i < end; i++) {
+      f(i);
+    }
+  }
+}
+
+template <typename F>
+inline void parallel_for(size_t start, size_t end, F f,
+                         const size_t chunksize) {
+  if (chunksize == 0) {
+    // like parlay a chunksize of 0 leaves it up to the runtime
+    parallel_for(start, end, f);
+  } else if ((end - start) <= chunksize) {
+    for (size_t i = start; i < end; i++) {
+      f(i);
+    }
+  } else if (omp_in_parallel()) {
+#pragma omp taskloop grainsize(chunksize) shared(f)
+    for (size_t i = start; i < end; i++) {
+      f(i);
+    }
+  } else {
+#pragma omp parallel for schedule(dynamic, chunksize)
+    for (size_t i = start; i < end; i++) {
+      f(i);
+    }
+  }
+}
+
+template <typename F>
+inline void parallel_for(size_t start, size_t end, size_t step, F f) {
+  if (omp_in_parallel()) {
+#pragma omp taskloop shared(f)
+    for (size_t i = start; i < end; i += step) {
+      f(i);
+    }
+  } else {
+#pragma omp parallel for
+    for (size_t i = start; i < end; i += step) {
+      f(i);
+    }
+  }
+}
+
+template <typename F, typename RAC>
+inline void parallel_for_each(RAC &container, F f, const size_t chunksize = 0) {
+  parallel_for(
+      0, container.size(), [&](size_t i) { f(container[i]); }, chunksize);
+}
+
+[[maybe_unused]] static int getWorkers() {
+  return omp_in_parallel() ? omp_get_num_threads() : omp_get_max_threads();
+}
+
+[[maybe_unused]] static int getWorkerNum() { return omp_get_thread_num(); }
+
+template <typename Lf, typename Rf> inline void par_do(Lf left, Rf right) {
+  openmp_in_region([&]() {
+#pragma omp task shared(right)
+    right();
+    left();
+#pragma omp taskwait
+  });
+}
+
+// running the function returns a vector
+// each element in the vector is run with the same function as the original
+// vector
+// each chunk of the container is a task and the expansion of an element is
+// done inside of its task, the taskgroup waits for all of them
+template <typename F, typename RAC>
+inline void parallel_for_each_spawn(RAC &container, F f,
+                                    const size_t chunksize = 0) {
+  size_t n = container.size();
+  size_t chunk = chunksize;
+  if (chunk == 0) {
+    chunk = n / (8 * static_cast<size_t>(getWorkers()));
+    chunk = (chunk == 0) ? 1 : ((chunk > 2048) ? 2048 : chunk);
+  }
+  openmp_in_region([&]() {
+#pragma omp taskgroup
+    {
+      for (size_t i = 0; i < n; i += chunk) {
+#pragma omp task firstprivate(i) shared(container, f)
+        {
+          size_t local_end = (i + chunk > n) ? n : i + chunk;
+          for (size_t j = i; j < local_end; j++) {
+            auto vec = f(container[j]);
+            parallel_for_each_spawn(vec, f, chunksize);
+          }
+        }
+      }
+    }
+  });
+}
+
+// std::thread work stealing
+#elif PT_THREADS == 1
+
+template <typename F>
+inline void parallel_for(size_t start, size_t end, F f,
+                         const size_t chunksize) {
+  if (end <= start) {
+    return;
+  }
+  // like parlay a chunksize of 0 picks the grain size automatically
+  size_t grain = (chunksize == 0)
+                     ? detail::scheduler_default_grain(end - start)
+                     : chunksize;
+  detail::scheduler_parallel_for(start, end, f, grain);
+}
+
+template <typename F> inline void parallel_for(size_t start, size_t end, F f) {
+  if (end <= start) {
+    return;
+  }
+  detail::scheduler_parallel_for(start, end, f,
+                                 detail::scheduler_default_grain(end - start));
+}
+
+template <typename F>
+inline void parallel_for(size_t start, size_t end, size_t step, F f) {
+  if (end <= start) {
+    return;
+  }
+  size_t last = (end - start + step - 1) / step;
+  parallel_for(0, last, [&](size_t i) { f(start + i * step); });
+}
+
+template <typename F, typename RAC>
+inline void parallel_for_each(RAC &container, F f, const size_t chunksize = 0) {
+  parallel_for(
+      0, container.size(), [&](size_t i) { f(container[i]); }, chunksize);
+}
+
+// running the function returns a vector
+// each element in the vector is run with the same function as the original
+// vector
+template <typename F, typename RAC>
+inline void parallel_for_each_spawn(RAC &container, F f,
+                                    const size_t chunksize = 0) {
+  parallel_for_each(
+      container,
+      [&](auto &element) {
+        auto vec = f(element);
+        parallel_for_each_spawn(vec, f, chunksize);
+      },
+      chunksize);
+}
+
+[[maybe_unused]] static int getWorkers() {
+  return detail::get_scheduler().num_workers();
+}
+
+[[maybe_unused]] static int getWorkerNum() {
+  // threads outside of the scheduler run serially and share slot 0 with the
+  // thread which started the scheduler, so only one of them may use per
+  // worker state like Reducer at a time
+  int id = detail::scheduler_worker_id;
+  return (id < 0) ? 0 : id;
+}
+
+template <typename Lf, typename Rf> inline void par_do(Lf left, Rf right) {
+  detail::scheduler_par_do(left, right);
+}
+
 // c++
 #else
 
@@ -227,6 +491,223 @@ template <typename Lf, typename Rf> inline void par_do(Lf left, Rf right) {
 
 #endif
 
+namespace detail {
+template <size_t start, size_t end, typename Tuple>
+inline void par_do_range(Tuple &functions) {
+  if constexpr (end - start == 1) {
+    std::get<start>(functions)();
+  } else {
+    constexpr size_t mid = start + (end - start) / 2;
+    ParallelTools::par_do(
+        [&]() { par_do_range<start, mid>(functions); },
+        [&]() { par_do_range<mid, end>(functions); });
+  }
+}
+} // namespace detail
+
+// runs any number of functions in parallel, they are split in half
+// recursively so the depth of the forks is logarithmic
+template <typename F1, typename F2, typename F3, typename... Fs>
+inline void par_do(F1 f1, F2 f2, F3 f3, Fs... fs) {
+  auto functions = std::forward_as_tuple(f1, f2, f3, fs...);
+  detail::par_do_range<0, 3 + sizeof...(Fs)>(functions);
+}
+
+// a dynamic number of tasks
+// run() adds a task and wait() returns once every task added so far, and any
+// tasks they added to the group, are done.  Tasks may call run() on the group
+// they belong to.
+//
+// with PT_THREADS and OPENMP each task is spawned as soon as it is added, so
+// it can overlap with the caller.  Under OPENMP a task added outside of a
+// parallel region has no team to run on, those wait until wait() opens one.
+// With CILK and PARLAY a spawn can not outlive the function which spawned it,
+// so the tasks are only collected by run() and start in wait(), this is for
+// fanning out to a number of tasks that is only known at runtime, not for
+// overlapping them with the caller.  Serially run() just runs the task.
+class task_group {
+#if PT_THREADS == 1
+  std::atomic<size_t> pending{0};
+
+public:
+  task_group() = default;
+  task_group(const task_group &) = delete;
+  task_group &operator=(const task_group &) = delete;
+  ~task_group() { wait(); }
+
+  template <typename F> void run(F f) {
+    int id = detail::scheduler_worker_id;
+    detail::scheduler &s = detail::get_scheduler();
+    if (id < 0 || s.num_workers() == 1) {
+      f();
+      return;
+    }
+    pending.fetch_add(1, std::memory_order_relaxed);
+    auto *j = new detail::group_job<F>(std::move(f), pending);
+    if (!s.spawn(id, j)) {
+      j->execute();
+    }
+  }
+
+  void wait() {
+    detail::get_scheduler().wait_group(detail::scheduler_worker_id, pending);
+  }
+#elif OPENMP == 1
+  std::atomic<size_t> pending{0};
+  // tasks added outside of a parallel region, only touched by that thread
+  std::vector<std::function<void()>> deferred;
+
+public:
+  task_group() = default;
+  task_group(const task_group &) = delete;
+  task_group &operator=(const task_group &) = delete;
+  ~task_group() { wait(); }
+
+  template <typename F> void run(F f) {
+    if (!omp_in_parallel()) {
+      deferred.emplace_back(std::move(f));
+      return;
+    }
+    pending.fetch_add(1, std::memory_order_relaxed);
+    // each task waits for the tasks it spawned, so a taskwait in wait() also
+    // covers the tasks which were added from inside of tasks
+#pragma omp task firstprivate(f)
+    {
+      f();
+#pragma omp taskwait
+      pending.fetch_sub(1, std::memory_order_release);
+    }
+  }
+
+  void wait() {
+    if (!deferred.empty()) {
+      // the region ends only once every task spawned inside of it is done
+      std::vector<std::function<void()>> batch;
+      batch.swap(deferred);
+      ParallelTools::parallel_for(
+          0, batch.size(), [&](size_t i) { batch[i](); }, 1);
+    }
+    if (omp_in_parallel()) {
+#pragma omp taskwait
+    }
+    // tasks added by code which is not a descendant of the caller
+    while (pending.load(std::memory_order_acquire) > 0) {
+#pragma omp taskyield
+    }
+  }
+#elif PARALLEL == 1
+  std::mutex lock;
+  std::vector<std::function<void()>> tasks;
+
+public:
+  task_group() = default;
+  task_group(const task_group &) = delete;
+  task_group &operator=(const task_group &) = delete;
+  ~task_group() { wait(); }
+
+  template <typename F> void run(F f) {
+    std::lock_guard<std::mutex> guard(lock);
+    tasks.emplace_back(std::move(f));
+  }
+
+  void wait() {
+    while (true) {
+      std::vector<std::function<void()>> batch;
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        batch.swap(tasks);
+      }
+      if (batch.empty()) {
+        return;
+      }
+      ParallelTools::parallel_for(
+          0, batch.size(), [&](size_t i) { batch[i](); }, 1);
+    }
+  }
+#else
+public:
+  task_group() = default;
+  task_group(const task_group &) = delete;
+  task_group &operator=(const task_group &) = delete;
+
+  template <typename F> void run(F f) { f(); }
+  void wait() {}
+#endif
+};
+
+namespace detail {
+// the loop is run serially until this much time has been spent so its cost
+// can be measured
+static constexpr double adaptive_sample_ns = 10000;
+// each chunk of the parallel part should take about this long
+static constexpr double adaptive_chunk_ns = 20000;
+
+// one per call site since every lambda has its own type
+// it holds a moving average of the time each iteration takes
+template <typename F> struct adaptive_grain_cache {
+  static inline std::atomic<double> ns_per_iteration{0};
+};
+} // namespace detail
+
+// a parallel_for which picks its own chunksize
+// the first iterations are run serially and timed until there is a good
+// sample, then the rest of the loop runs in chunks which each take about
+// adaptive_chunk_ns.  The cost per iteration is remembered for the call site
+// so later calls start from it and converge, a loop which is too short to be
+// worth parallelizing just runs serially.
+// all calls with the same type of F share the estimate, so this should be
+// used with lambdas and not function pointers or std::function
+template <typename F>
+inline void parallel_for_adaptive(size_t start, size_t end, F f) {
+  if (end <= start) {
+    return;
+  }
+  if (PARALLEL == 0) {
+    serial_for(start, end, f);
+    return;
+  }
+  auto &cache = detail::adaptive_grain_cache<F>::ns_per_iteration;
+  double cached = cache.load(std::memory_order_relaxed);
+  // with an estimate the sample is done in a single step
+  size_t count = 1;
+  if (cached > 0) {
+    count = static_cast<size_t>(detail::adaptive_sample_ns / cached) + 1;
+  }
+  size_t done = 0;
+  double elapsed = 0;
+  while (start + done < end && elapsed < detail::adaptive_sample_ns) {
+    size_t local_end = start + done + count;
+    if (local_end > end) {
+      local_end = end;
+    }
+    auto sample_start = std::chrono::steady_clock::now();
+    for (size_t i = start + done; i < local_end; i++) {
+      f(i);
+    }
+    elapsed += std::chrono::duration<double, std::nano>(
+                   std::chrono::steady_clock::now() - sample_start)
+                   .count();
+    done = local_end - start;
+    count *= 2;
+  }
+  double measured = elapsed / static_cast<double>(done);
+  double cost = (cached > 0) ? 0.75 * cached + 0.25 * measured : measured;
+  cache.store(cost, std::memory_order_relaxed);
+  size_t remaining = end - start - done;
+  if (remaining == 0) {
+    return;
+  }
+  // less than a couple of chunks of work left is not worth spreading out
+  if (cost * static_cast<double>(remaining) < 2 * detail::adaptive_chunk_ns) {
+    serial_for(start + done, end, f);
+    return;
+  }
+  // chunks are never made smaller than the cost says is worth a task, a loop
+  // with only a few chunks of work just uses fewer workers
+  size_t grain = static_cast<size_t>(detail::adaptive_chunk_ns / cost) + 1;
+  parallel_for(start + done, end, f, grain);
+}
+
 template <bool parallel, typename F>
 inline void For(size_t start, size_t end, F f) {
   if constexpr (parallel) {
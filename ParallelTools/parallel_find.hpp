@@ -0,0 +1,106 @@
+#pragma once
+
+#include "parallel.h"
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <iterator>
+
+namespace ParallelTools {
+
+namespace detail {
+
+// the first block is always searched serially, so a match near the start
+// costs the same as std::find_if
+static constexpr size_t find_first_block = 1UL << 12U;
+// the cancellation flag is checked before each chunk
+static constexpr size_t find_chunk = 1UL << 10U;
+
+// returns the lowest index in [start, end) for which pred is true, or end if
+// there is none.  If first_match is false any matching index may be returned.
+//
+// after the serial first block the range is searched in blocks which double
+// in size, each block is searched in parallel and the search stops after the
+// first block with a match, so the work done past a match at index i is
+// O(i).  Inside of a block chunks which can no longer change the answer are
+// skipped.
+template <bool first_match, class Pred>
+size_t find_index(size_t start, size_t end, const Pred &pred) {
+  size_t block_start = start;
+  size_t block_size = find_first_block;
+  size_t block_end = std::min(end, block_start + block_size);
+  if (PARALLEL == 0) {
+    block_end = end;
+  }
+  for (size_t i = block_start; i < block_end; i++) {
+    if (pred(i)) {
+      return i;
+    }
+  }
+  block_start = block_end;
+  std::atomic<size_t> found{end};
+  while (block_start < end) {
+    block_size *= 2;
+    block_end = std::min(end, block_start + block_size);
+    size_t num_chunks = (block_end - block_start + find_chunk - 1) / find_chunk;
+    ParallelTools::parallel_for(0, num_chunks, [&](size_t c) {
+      size_t chunk_start = block_start + c * find_chunk;
+      size_t chunk_end = std::min(chunk_start + find_chunk, block_end);
+      size_t current = found.load(std::memory_order_relaxed);
+      if (first_match ? current < chunk_start : current != end) {
+        return;
+      }
+      for (size_t i = chunk_start; i < chunk_end; i++) {
+        if (pred(i)) {
+          while (i < current && !found.compare_exchange_weak(
+                                    current, i, std::memory_order_relaxed)) {
+          }
+          return;
+        }
+      }
+    });
+    size_t result = found.load(std::memory_order_relaxed);
+    if (result != end) {
+      return result;
+    }
+    block_start = block_end;
+  }
+  return end;
+}
+
+} // namespace detail
+
+// the first element for which pred is true, or last
+template <class RandomIt, class UnaryPredicate>
+RandomIt parallel_find_if(RandomIt first, RandomIt last, UnaryPredicate pred) {
+  return first + detail::find_index<true>(
+                     0, last - first, [&](size_t i) { return pred(first[i]); });
+}
+
+// some element for which pred is true, or last
+// not necessarily the first one, so it can stop as soon as any worker finds
+// a match
+template <class RandomIt, class UnaryPredicate>
+RandomIt parallel_find_any(RandomIt first, RandomIt last, UnaryPredicate pred) {
+  return first + detail::find_index<false>(
+                     0, last - first, [&](size_t i) { return pred(first[i]); });
+}
+
+template <class RandomIt, class UnaryPredicate>
+bool any_of(RandomIt first, RandomIt last, UnaryPredicate pred) {
+  return ParallelTools::parallel_find_any(first, last, pred) != last;
+}
+
+template <class RandomIt, class UnaryPredicate>
+bool all_of(RandomIt first, RandomIt last, UnaryPredicate pred) {
+  return ParallelTools::parallel_find_any(first, last, [&](const auto &e) {
+           return !pred(e);
+         }) == last;
+}
+
+template <class RandomIt, class UnaryPredicate>
+bool none_of(RandomIt first, RandomIt last, UnaryPredicate pred) {
+  return ParallelTools::parallel_find_any(first, last, pred) == last;
+}
+
+} // namespace ParallelTools
@@ -0,0 +1,286 @@
+#pragma once
+
+#include "parallel.h"
+#include <cstddef>
+
+namespace ParallelTools {
+
+// 2d and 3d loops over blocked iteration spaces
+//
+// the tiled versions cut the space into tiles of the given size and run each
+// tile serially, so each tile should be small enough for the data it touches
+// to stay in cache.  The recursive versions are cache oblivious, they split
+// the largest dimension in half until a piece is no larger than a tile.
+// Both are built on parallel_for and par_do so they run on every backend.
+
+static constexpr size_t default_tile_2d = 32;
+static constexpr size_t default_tile_3d = 16;
+
+namespace detail {
+
+inline size_t num_tiles(size_t start, size_t end, size_t tile) {
+  return (end - start + tile - 1) / tile;
+}
+
+inline size_t min_size(size_t a, size_t b) { return (a < b) ? a : b; }
+
+template <typename F>
+inline void serial_block_2d(size_t start_i, size_t end_i, size_t start_j,
+                            size_t end_j, F &f) {
+  for (size_t i = start_i; i < end_i; i++) {
+    for (size_t j = start_j; j < end_j; j++) {
+      f(i, j);
+    }
+  }
+}
+
+template <typename F>
+inline void serial_block_3d(size_t start_i, size_t end_i, size_t start_j,
+                            size_t end_j, size_t start_k, size_t end_k, F &f) {
+  for (size_t i = start_i; i < end_i; i++) {
+    for (size_t j = start_j; j < end_j; j++) {
+      for (size_t k = start_k; k < end_k; k++) {
+        f(i, j, k);
+      }
+    }
+  }
+}
+
+template <bool parallel, typename F>
+inline void tiled_for_2d(size_t start_i, size_t end_i, size_t start_j,
+                         size_t end_j, F &f, size_t tile_i, size_t tile_j) {
+  if (end_i <= start_i || end_j <= start_j) {
+    return;
+  }
+  tile_i = (tile_i == 0) ? 1 : tile_i;
+  tile_j = (tile_j == 0) ? 1 : tile_j;
+  size_t tiles_j = num_tiles(start_j, end_j, tile_j);
+  size_t tiles = num_tiles(start_i, end_i, tile_i) * tiles_j;
+  For<parallel>(0, tiles, [&](size_t t) {
+    size_t i = start_i + (t / tiles_j) * tile_i;
+    size_t j = start_j + (t % tiles_j) * tile_j;
+    serial_block_2d(i, min_size(i + tile_i, end_i), j,
+                    min_size(j + tile_j, end_j), f);
+  });
+}
+
+template <bool parallel, typename F>
+inline void tiled_for_3d(size_t start_i, size_t end_i, size_t start_j,
+                         size_t end_j, size_t start_k, size_t end_k, F &f,
+                         size_t tile_i, size_t tile_j, size_t tile_k) {
+  if (end_i <= start_i || end_j <= start_j || end_k <= start_k) {
+    return;
+  }
+  tile_i = (tile_i == 0) ? 1 : tile_i;
+  tile_j = (tile_j == 0) ? 1 : tile_j;
+  tile_k = (tile_k == 0) ? 1 : tile_k;
+  size_t tiles_j = num_tiles(start_j, end_j, tile_j);
+  size_t tiles_k = num_tiles(start_k, end_k, tile_k);
+  size_t tiles = num_tiles(start_i, end_i, tile_i) * tiles_j * tiles_k;
+  For<parallel>(0, tiles, [&](size_t t) {
+    size_t i = start_i + (t / (tiles_j * tiles_k)) * tile_i;
+    size_t j = start_j + ((t / tiles_k) % tiles_j) * tile_j;
+    size_t k = start_k + (t % tiles_k) * tile_k;
+    serial_block_3d(i, min_size(i + tile_i, end_i), j,
+                    min_size(j + tile_j, end_j), k,
+                    min_size(k + tile_k, end_k), f);
+  });
+}
+
+template <bool parallel, typename Lf, typename Rf>
+inline void maybe_par_do(Lf left, Rf right) {
+  if constexpr (parallel) {
+    par_do(left, right);
+  } else {
+    left();
+    right();
+  }
+}
+
+template <bool parallel, typename F>
+inline void recursive_for_2d(size_t start_i, size_t end_i, size_t start_j,
+                             size_t end_j, F &f, size_t base_size) {
+  size_t n_i = end_i - start_i;
+  size_t n_j = end_j - start_j;
+  if (n_i * n_j <= base_size || (n_i <= 1 && n_j <= 1)) {
+    serial_block_2d(start_i, end_i, start_j, end_j, f);
+    return;
+  }
+  if (n_i >= n_j) {
+    size_t mid = start_i + n_i / 2;
+    maybe_par_do<parallel>(
+        [&]() {
+          recursive_for_2d<parallel>(start_i, mid, start_j, end_j, f,
+                                     base_size);
+        },
+        [&]() {
+          recursive_for_2d<parallel>(mid, end_i, start_j, end_j, f,
+                                     base_size);
+        });
+  } else {
+    size_t mid = start_j + n_j / 2;
+    maybe_par_do<parallel>(
+        [&]() {
+          recursive_for_2d<parallel>(start_i, end_i, start_j, mid, f,
+                                     base_size);
+        },
+        [&]() {
+          recursive_for_2d<parallel>(start_i, end_i, mid, end_j, f,
+                                     base_size);
+        });
+  }
+}
+
+template <bool parallel, typename F>
+inline void recursive_for_3d(size_t start_i, size_t end_i, size_t start_j,
+                             size_t end_j, size_t start_k, size_t end_k, F &f,
+                             size_t base_size) {
+  size_t n_i = end_i - start_i;
+  size_t n_j = end_j - start_j;
+  size_t n_k = end_k - start_k;
+  if (n_i * n_j * n_k <= base_size || (n_i <= 1 && n_j <= 1 && n_k <= 1)) {
+    serial_block_3d(start_i, end_i, start_j, end_j, start_k, end_k, f);
+    return;
+  }
+  if (n_i >= n_j && n_i >= n_k) {
+    size_t mid = start_i + n_i / 2;
+    maybe_par_do<parallel>(
+        [&]() {
+          recursive_for_3d<parallel>(start_i, mid, start_j, end_j, start_k,
+                                     end_k, f, base_size);
+        },
+        [&]() {
+          recursive_for_3d<parallel>(mid, end_i, start_j, end_j, start_k,
+                                     end_k, f, base_size);
+        });
+  } else if (n_j >= n_k) {
+    size_t mid = start_j + n_j / 2;
+    maybe_par_do<parallel>(
+        [&]() {
+          recursive_for_3d<parallel>(start_i, end_i, start_j, mid, start_k,
+                                     end_k, f, base_size);
+        },
+        [&]() {
+          recursive_for_3d<parallel>(start_i, end_i, mid, end_j, start_k,
+                                     end_k, f, base_size);
+        });
+  } else {
+    size_t mid = start_k + n_k / 2;
+    maybe_par_do<parallel>(
+        [&]() {
+          recursive_for_3d<parallel>(start_i, end_i, start_j, end_j, start_k,
+                                     mid, f, base_size);
+        },
+        [&]() {
+          recursive_for_3d<parallel>(start_i, end_i, start_j, end_j, mid,
+                                     end_k, f, base_size);
+        });
+  }
+}
+
+} // namespace detail
+
+// f(i, j) for every i in [start_i, end_i) and j in [start_j, end_j)
+// inside of a tile j changes fastest
+template <typename F>
+inline void parallel_for_2d(size_t start_i, size_t end_i, size_t start_j,
+                            size_t end_j, F f,
+                            size_t tile_i = default_tile_2d,
+                            size_t tile_j = default_tile_2d) {
+  detail::tiled_for_2d<true>(start_i, end_i, start_j, end_j, f, tile_i,
+                             tile_j);
+}
+
+template <typename F>
+inline void serial_for_2d(size_t start_i, size_t end_i, size_t start_j,
+                          size_t end_j, F f, size_t tile_i = default_tile_2d,
+                          size_t tile_j = default_tile_2d) {
+  detail::tiled_for_2d<false>(start_i, end_i, start_j, end_j, f, tile_i,
+                              tile_j);
+}
+
+// f(i, j, k) for every i in [start_i, end_i), j in [start_j, end_j) and k in
+// [start_k, end_k)
+// inside of a tile k changes fastest
+template <typename F>
+inline void parallel_for_3d(size_t start_i, size_t end_i, size_t start_j,
+                            size_t end_j, size_t start_k, size_t end_k, F f,
+                            size_t tile_i = default_tile_3d,
+                            size_t tile_j = default_tile_3d,
+                            size_t tile_k = default_tile_3d) {
+  detail::tiled_for_3d<true>(start_i, end_i, start_j, end_j, start_k, end_k, f,
+                             tile_i, tile_j, tile_k);
+}
+
+template <typename F>
+inline void serial_for_3d(size_t start_i, size_t end_i, size_t start_j,
+                          size_t end_j, size_t start_k, size_t end_k, F f,
+                          size_t tile_i = default_tile_3d,
+                          size_t tile_j = default_tile_3d,
+                          size_t tile_k = default_tile_3d) {
+  detail::tiled_for_3d<false>(start_i, end_i, start_j, end_j, start_k, end_k,
+                              f, tile_i, tile_j, tile_k);
+}
+
+// the cache oblivious versions, pieces with at most base_size points are run
+// serially
+template <typename F>
+inline void parallel_for_2d_recursive(
+    size_t start_i, size_t end_i, size_t start_j, size_t end_j, F f,
+    size_t base_size = default_tile_2d * default_tile_2d) {
+  if (end_i <= start_i || end_j <= start_j) {
+    return;
+  }
+  detail::recursive_for_2d<true>(start_i, end_i, start_j, end_j, f,
+                                 base_size);
+}
+
+template <typename F>
+inline void parallel_for_3d_recursive(
+    size_t start_i, size_t end_i, size_t start_j, size_t end_j, size_t start_k,
+    size_t end_k, F f,
+    size_t base_size = default_tile_3d * default_tile_3d * default_tile_3d) {
+  if (end_i <= start_i || end_j <= start_j || end_k <= start_k) {
+    return;
+  }
+  detail::recursive_for_3d<true>(start_i, end_i, start_j, end_j, start_k,
+                                 end_k, f, base_size);
+}
+
+// like For, recursive picks the cache oblivious splitting and then a piece is
+// split until it is no larger than a tile
+template <bool parallel, bool recursive = false, typename F>
+inline void For2D(size_t start_i, size_t end_i, size_t start_j, size_t end_j,
+                  F f, size_t tile_i = default_tile_2d,
+                  size_t tile_j = default_tile_2d) {
+  if (end_i <= start_i || end_j <= start_j) {
+    return;
+  }
+  if constexpr (recursive) {
+    detail::recursive_for_2d<parallel>(start_i, end_i, start_j, end_j, f,
+                                       tile_i * tile_j);
+  } else {
+    detail::tiled_for_2d<parallel>(start_i, end_i, start_j, end_j, f, tile_i,
+                                   tile_j);
+  }
+}
+
+template <bool parallel, bool recursive = false, typename F>
+inline void For3D(size_t start_i, size_t end_i, size_t start_j, size_t end_j,
+                  size_t start_k, size_t end_k, F f,
+                  size_t tile_i = default_tile_3d,
+                  size_t tile_j = default_tile_3d,
+                  size_t tile_k = default_tile_3d) {
+  if (end_i <= start_i || end_j <= start_j || end_k <= start_k) {
+    return;
+  }
+  if constexpr (recursive) {
+    detail::recursive_for_3d<parallel>(start_i, end_i, start_j, end_j, start_k,
+                                       end_k, f, tile_i * tile_j * tile_k);
+  } else {
+    detail::tiled_for_3d<parallel>(start_i, end_i, start_j, end_j, start_k,
+                                   end_k, f, tile_i, tile_j, tile_k);
+  }
+}
+
+} // namespace ParallelTools
@@ -0,0 +1,74 @@
+#pragma once
+
+#include "parallel.h"
+#include <algorithm>
+#include <cstddef>
+
+namespace ParallelTools {
+
+namespace detail {
+
+template <class T, class Map, class Combine>
+T parallel_reduce_recursive(size_t start, size_t end, const T &identity,
+                            const Map &map, const Combine &combine,
+                            size_t grain) {
+  if (end - start <= grain) {
+    T value = identity;
+    for (size_t i = start; i < end; i++) {
+      value = combine(value, map(i));
+    }
+    return value;
+  }
+  size_t mid = start + (end - start) / 2;
+  T left = identity;
+  T right = identity;
+  ParallelTools::par_do(
+      [&]() {
+        left = parallel_reduce_recursive(start, mid, identity, map, combine,
+                                         grain);
+      },
+      [&]() {
+        right = parallel_reduce_recursive(mid, end, identity, map, combine,
+                                          grain);
+      });
+  return combine(left, right);
+}
+
+} // namespace detail
+
+// combine(identity, map(start), map(start + 1), ..., map(end - 1))
+// combine must be associative and identity must be its identity, it does not
+// need to be commutative since the pieces are always combined in order
+// the range is split in half recursively with par_do until the pieces are at
+// most grain long, so each piece is folded into a local and nothing is shared
+// between workers.  A grain of 0 picks one so that there are a few pieces for
+// each worker.
+template <class T, class Map, class Combine>
+T parallel_reduce(size_t start, size_t end, T identity, Map map,
+                  Combine combine, size_t grain = 0) {
+  if (end <= start) {
+    return identity;
+  }
+  size_t n = end - start;
+  if (PARALLEL == 0) {
+    return detail::parallel_reduce_recursive(start, end, identity, map,
+                                             combine, n);
+  }
+  if (grain == 0) {
+    grain = std::max<size_t>(
+        n / (8 * static_cast<size_t>(ParallelTools::getWorkers())), 2048);
+  }
+  return detail::parallel_reduce_recursive(start, end, identity, map, combine,
+                                           grain);
+}
+
+// combine(identity, map(container[0]), ..., map(container[size - 1]))
+template <class T, class RAC, class Map, class Combine>
+T transform_reduce(const RAC &container, T identity, Map map, Combine combine,
+                   size_t grain = 0) {
+  return ParallelTools::parallel_reduce(
+      0, container.size(), identity,
+      [&](size_t i) { return map(container[i]); }, combine, grain);
+}
+
+} // namespace ParallelTools
@@ -1,13 +1,160 @@
 #pragma once
 
 #include "parallel.h"
+#include <algorithm>
+#include <functional>
+#include <iterator>
 #include <vector>
 
 namespace ParallelTools {
 
+// a half open range of indices [begin, end)
+// any type which can be constructed from a begin and end index and exposes
+// begin() and end() can be used as the Range for parallel_scan
+class index_range {
+  size_t begin_;
+  size_t end_;
+
+public:
+  index_range(size_t begin, size_t end) : begin_(begin), end_(end) {}
+  [[nodiscard]] size_t begin() const { return begin_; }
+  [[nodiscard]] size_t end() const { return end_; }
+  [[nodiscard]] size_t size() const { return end_ - begin_; }
+};
+
+// a work efficient two pass (reduce then scan) parallel prefix
+//
+// scan(sub_range, running_value, is_final) is called on contiguous pieces of
+// the range.  It must fold each index of sub_range into running_value and
+// return the result.  When is_final is true running_value is the prefix of
+// everything before sub_range and the results for each index should be
+// written out, when it is false only the total is needed.
+//
+// combine(left, right) merges the totals of two neighboring pieces, the
+// pieces are always passed in order.
+//
+// returns what the final call to scan on the last piece returned, which is
+// the total over the whole range
 template <typename Range, typename Value, typename Scan, typename Combine>
 Value parallel_scan(const Range &range, const Value &identity, const Scan &scan,
-                    const Combine &combine, size_t min_serial_size) {
-  // TODO
+                    const Combine &combine, size_t min_serial_size = 2048) {
+  size_t start = range.begin();
+  size_t end = range.end();
+  size_t n = end - start;
+  if (min_serial_size == 0) {
+    min_serial_size = 1;
+  }
+  if (PARALLEL == 0 || n <= min_serial_size || getWorkers() == 1) {
+    return scan(Range(start, end), identity, true);
+  }
+  // a few blocks per worker so the scan pass can load balance, but few enough
+  // that combining the block totals serially is free
+  size_t num_blocks = std::min((n + min_serial_size - 1) / min_serial_size,
+                               static_cast<size_t>(getWorkers()) * 8);
+  size_t block_size = (n + num_blocks - 1) / num_blocks;
+  num_blocks = (n + block_size - 1) / block_size;
+
+  std::vector<Value> block_values(num_blocks, identity);
+  parallel_for(
+      0, num_blocks,
+      [&](size_t i) {
+        size_t block_start = start + i * block_size;
+        size_t block_end = std::min(block_start + block_size, end);
+        block_values[i] = scan(Range(block_start, block_end), identity, false);
+      },
+      1);
+  // turn the block totals into the prefix before each block
+  Value prefix = identity;
+  for (size_t i = 0; i < num_blocks; i++) {
+    Value block_total = block_values[i];
+    block_values[i] = prefix;
+    prefix = combine(prefix, block_total);
+  }
+  Value total = identity;
+  parallel_for(
+      0, num_blocks,
+      [&](size_t i) {
+        size_t block_start = start + i * block_size;
+        size_t block_end = std::min(block_start + block_size, end);
+        Value value =
+            scan(Range(block_start, block_end), block_values[i], true);
+        if (i == num_blocks - 1) {
+          total = value;
+        }
+      },
+      1);
+  return total;
+}
+
+// d_first[i] = first[0] op ... op first[i]
+// first and d_first may be the same to scan in place
+// returns the total
+template <class InputIt, class OutputIt, class BinaryOp = std::plus<>,
+          class T = typename std::iterator_traits<InputIt>::value_type>
+T inclusive_scan(InputIt first, InputIt last, OutputIt d_first,
+                 BinaryOp op = std::plus<>(), T identity = T(),
+                 size_t min_serial_size = 2048) {
+  return parallel_scan(
+      index_range(0, last - first), identity,
+      [&](const index_range &r, T value, bool is_final) {
+        if (is_final) {
+          for (size_t i = r.begin(); i < r.end(); i++) {
+            value = op(value, first[i]);
+            d_first[i] = value;
+          }
+        } else {
+          for (size_t i = r.begin(); i < r.end(); i++) {
+            value = op(value, first[i]);
+          }
+        }
+        return value;
+      },
+      op, min_serial_size);
+}
+
+// d_first[i] = init op first[0] op ... op first[i-1]
+// first and d_first may be the same to scan in place
+// returns the total including init
+template <class InputIt, class OutputIt, class T, class BinaryOp = std::plus<>>
+T exclusive_scan(InputIt first, InputIt last, OutputIt d_first, T init,
+                 BinaryOp op = std::plus<>(), T identity = T(),
+                 size_t min_serial_size = 2048) {
+  return parallel_scan(
+      index_range(0, last - first), identity,
+      [&](const index_range &r, T value, bool is_final) {
+        if (is_final) {
+          value = op(init, value);
+          for (size_t i = r.begin(); i < r.end(); i++) {
+            T next = op(value, first[i]);
+            d_first[i] = value;
+            value = next;
+          }
+        } else {
+          for (size_t i = r.begin(); i < r.end(); i++) {
+            value = op(value, first[i]);
+          }
+        }
+        return value;
+      },
+      op, min_serial_size);
+}
+
+template <class RandomIt, class BinaryOp = std::plus<>,
+          class T = typename std::iterator_traits<RandomIt>::value_type>
+T inclusive_scan_inplace(RandomIt first, RandomIt last,
+                         BinaryOp op = std::plus<>(), T identity = T(),
+                         size_t min_serial_size = 2048) {
+  return inclusive_scan(first, last, first, op, identity, min_serial_size);
 }
+
+template <class RandomIt,
+          class T = typename std::iterator_traits<RandomIt>::value_type,
+          class BinaryOp = std::plus<>>
+T exclusive_scan_inplace(RandomIt first, RandomIt last, T init = T(),
+                         BinaryOp op = std::plus<>(), T identity = T(),
+                         size_t min_serial_size = 2048) {
+  return exclusive_scan(first, last, first, init, op, identity,
+                        min_serial_size);
+}
+
 } // namespace ParallelTools
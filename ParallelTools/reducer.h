@@ -1,20 +1,139 @@
 #pragma once
 
+#include "default_init_allocator.hpp"
 #include "parallel.h"
+#include "parallel_find.hpp"
 #include "sort.hpp"
 #include <type_traits>
 #if CILK == 1
 #include <cilk/cilksan.h>
 #endif
 
+// CILK_HYPEROBJECTS=1 backs Reducer<F>, Reducer_sum and Reducer_Vector with
+// OpenCilk reducer hyperobjects instead of per-worker slots
+#if CILK_HYPEROBJECTS == 1
+#if CILK != 1
+#error "CILK_HYPEROBJECTS requires CILK=1"
+#endif
+#include <cilk/cilk.h>
+#endif
+
 #include <algorithm>
 #include <cstring>
 #include <functional>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <new>
+#include <utility>
 #include <vector>
 
 namespace ParallelTools {
 
-template <class F> class Reducer {
+namespace detail {
+// the value initialized T, which is 0 for arithmetic types
+template <class T> struct zero_identity {
+  T operator()() const { return T(); }
+};
+} // namespace detail
+
+// a reducer over the monoid (T, op, identity())
+// op(a, b) must be associative and identity() must return its identity, each
+// worker folds its updates into its own padded slot starting from identity()
+// and get() combines the slots in order
+// when only an op is given the identity is the value initialized T, so
+// Reducer<long, std::plus<long>> sums from 0
+// with lambdas the types can be deduced with make_reducer
+//
+// Reducer<F> with a single type is the older form where F is a struct with an
+// update method and a default constructor that makes the identity
+template <class T, class Op = void,
+          class Identity = std::conditional_t<std::is_void_v<Op>, void,
+                                              detail::zero_identity<T>>>
+class Reducer {
+
+#ifdef __cpp_lib_hardware_interference_size
+  static constexpr std::size_t hardware_constructive_interference_size =
+      std::hardware_constructive_interference_size;
+  static constexpr std::size_t hardware_destructive_interference_size =
+      std::hardware_destructive_interference_size;
+#else
+  // 64 bytes on x86-64 │ L1_CACHE_BYTES │ L1_CACHE_SHIFT │ __cacheline_aligned
+  // │
+  // ...
+  static constexpr std::size_t hardware_constructive_interference_size = 64;
+  static constexpr std::size_t hardware_destructive_interference_size = 64;
+#endif
+
+  struct aligned_f {
+#if PARALLEL == 1
+    alignas(hardware_destructive_interference_size) T f;
+#else
+    T f;
+#endif
+  };
+  std::vector<aligned_f> data;
+  Op op;
+  Identity identity;
+
+#if CILK == 1
+  // so cilksan doesn't report races on accesses to the vector which I make sure
+  // are fine by using getWorkerNum()
+  Cilksan_fake_mutex fake_lock;
+#endif
+
+public:
+  explicit Reducer(Op op_ = Op(), Identity identity_ = Identity())
+      : op(op_), identity(identity_) {
+    data.resize(ParallelTools::getWorkers());
+    for (auto &d : data) {
+      d.f = identity();
+    }
+  }
+  void update(const T &new_value) {
+    int worker_num = getWorkerNum();
+#if CILK == 1
+    Cilksan_fake_lock_guard guad(&fake_lock);
+#endif
+    data[worker_num].f = op(data[worker_num].f, new_value);
+  }
+  T get() const {
+    T output = identity();
+    for (const auto &d : data) {
+      output = op(output, d.f);
+    }
+    return output;
+  }
+};
+
+template <class T, class Op, class Identity>
+Reducer<T, Op, Identity> make_reducer(Op op, Identity identity) {
+  return Reducer<T, Op, Identity>(op, identity);
+}
+
+namespace detail {
+// an F with `static constexpr bool parallel_combine = true` is combined in a
+// tree instead of in one loop, for states like histograms or large vectors
+// where each update is expensive
+template <class F, class = void>
+struct has_parallel_combine : std::false_type {};
+template <class F>
+struct has_parallel_combine<F, std::void_t<decltype(F::parallel_combine)>>
+    : std::bool_constant<F::parallel_combine> {};
+template <class F>
+inline constexpr bool has_parallel_combine_v = has_parallel_combine<F>::value;
+} // namespace detail
+
+// get() returns a copy of the total and leaves the slots alone, combine()
+// folds every slot into the first one in place, resetting the others to the
+// identity, and returns a reference to it.  combine() avoids copying the
+// state, but it must not run at the same time as update, get or another
+// combine, and the reference is only valid until the next update or combine.
+//
+// with F::parallel_combine both merge the worker slots pairwise in a binary
+// tree using par_do, so F::update may itself be parallel.  Slots which have
+// not been updated since the last combine are skipped.
+template <class F> class Reducer<F, void, void> {
 
 #ifdef __cpp_lib_hardware_interference_size
   static constexpr std::size_t hardware_constructive_interference_size =
@@ -29,12 +148,37 @@ template <class F> class Reducer {
   static constexpr std::size_t hardware_destructive_interference_size = 64;
 #endif
 
+#if CILK_HYPEROBJECTS == 1
+  static void identity_view(void *view) { new (view) F(); }
+  static void reduce_views(void *left, void *right) {
+    static_cast<F *>(left)->update(*static_cast<F *>(right));
+    static_cast<F *>(right)->~F();
+  }
+  // the runtime makes a new view for each strand that needs one and joins
+  // them in the serial order, so there are no per-worker slots to pad or lock
+  F cilk_reducer(identity_view, reduce_views) value;
+
+public:
+  Reducer() {}
+  void update(F new_values) { value.update(new_values); }
+  F get() const {
+    F output;
+    output.update(value);
+    return output;
+  }
+  const F &combine() { return value; }
+#else
+  static constexpr bool parallel_combine = detail::has_parallel_combine_v<F>;
+
   struct aligned_f {
 #if PARALLEL == 1
     alignas(hardware_destructive_interference_size) F f;
 #else
     F f;
 #endif
+    // set by update, with parallel_combine a slot which is not dirty holds
+    // the identity, except for the first one which may hold the last total
+    bool dirty = false;
   };
   std::vector<aligned_f> data;
 
@@ -44,6 +188,57 @@ template <class F> class Reducer {
   Cilksan_fake_mutex fake_lock;
 #endif
 
+  // combines copies of the slots in [start, end) into output, slots known to
+  // hold the identity are skipped
+  // returns if output was written to
+  bool combine_copies(size_t start, size_t end, F &output) const {
+    if (end - start == 1) {
+      if (start != 0 && !data[start].dirty) {
+        return false;
+      }
+      output = data[start].f;
+      return true;
+    }
+    size_t mid = start + (end - start) / 2;
+    F right_output;
+    bool left = false;
+    bool right = false;
+    ParallelTools::par_do(
+        [&]() { left = combine_copies(start, mid, output); },
+        [&]() { right = combine_copies(mid, end, right_output); });
+    if (right) {
+      if (left) {
+        output.update(right_output);
+      } else {
+        output = std::move(right_output);
+      }
+    }
+    return left || right;
+  }
+
+  // combines the slots in [start, end) into slot start and resets the rest
+  // to the identity, slots known to hold the identity are skipped
+  // returns if slot start holds anything afterwards
+  bool combine_slots(size_t start, size_t end) {
+    if (end - start == 1) {
+      return start == 0 || data[start].dirty;
+    }
+    size_t mid = start + (end - start) / 2;
+    bool left = false;
+    bool right = false;
+    ParallelTools::par_do([&]() { left = combine_slots(start, mid); },
+                          [&]() { right = combine_slots(mid, end); });
+    if (right) {
+      if (left) {
+        data[start].f.update(data[mid].f);
+      } else {
+        data[start].f = std::move(data[mid].f);
+      }
+      data[mid].f = F();
+    }
+    return left || right;
+  }
+
 public:
   Reducer() { data.resize(ParallelTools::getWorkers()); }
   void update(F new_values) {
@@ -52,14 +247,42 @@ public:
     Cilksan_fake_lock_guard guad(&fake_lock);
 #endif
     data[worker_num].f.update(new_values);
+    if constexpr (parallel_combine) {
+      data[worker_num].dirty = true;
+    }
   }
   F get() const {
     F output;
-    for (const auto &d : data) {
-      output.update(d.f);
+    if constexpr (parallel_combine) {
+      combine_copies(0, data.size(), output);
+    } else {
+      for (const auto &d : data) {
+        output.update(d.f);
+      }
     }
     return output;
   }
+  const F &combine() {
+    if constexpr (parallel_combine) {
+      bool dirty = false;
+      for (const auto &d : data) {
+        dirty |= d.dirty;
+      }
+      if (dirty) {
+        combine_slots(0, data.size());
+        for (auto &d : data) {
+          d.dirty = false;
+        }
+      }
+    } else {
+      for (size_t i = 1; i < data.size(); i++) {
+        data[0].f.update(data[i].f);
+        data[i].f = F();
+      }
+    }
+    return data[0].f;
+  }
+#endif
 };
 
 template <class T> class Reducer_sum {
@@ -101,22 +324,134 @@ public:
   operator T() const { return get(); }
 };
 
+namespace detail {
+template <class T> struct max_op {
+  T operator()(const T &a, const T &b) const { return std::max(a, b); }
+};
+template <class T> struct min_op {
+  T operator()(const T &a, const T &b) const { return std::min(a, b); }
+};
+template <class T> struct lowest_identity {
+  T operator()() const { return std::numeric_limits<T>::lowest(); }
+};
+template <class T> struct highest_identity {
+  T operator()() const { return std::numeric_limits<T>::max(); }
+};
+
+// a value and where it came from, ties go to the smaller index so the result
+// does not depend on the schedule
+template <class T, class Index, bool max> struct arg_op {
+  std::pair<T, Index> operator()(const std::pair<T, Index> &a,
+                                 const std::pair<T, Index> &b) const {
+    bool a_better = max ? (b.first < a.first) : (a.first < b.first);
+    bool b_better = max ? (a.first < b.first) : (b.first < a.first);
+    if (a_better || (!b_better && a.second <= b.second)) {
+      return a;
+    }
+    return b;
+  }
+};
+template <class T, class Index, bool max> struct arg_identity {
+  std::pair<T, Index> operator()() const {
+    return {max ? std::numeric_limits<T>::lowest()
+                : std::numeric_limits<T>::max(),
+            std::numeric_limits<Index>::max()};
+  }
+};
+
+template <class T> struct all_ones_identity {
+  T operator()() const { return static_cast<T>(~T(0)); }
+};
+} // namespace detail
+
 template <class T> class Reducer_max {
-  struct F {
-    T value;
-    void update(const F new_value) { value = std::max(value, new_value.value); }
-    F(T t) : value(t) {}
-    F() : value(0) {}
-  };
-  Reducer<F> reducer;
+  Reducer<T, detail::max_op<T>, detail::lowest_identity<T>> reducer;
 
 public:
   Reducer_max() {}
   void update(T new_value) { reducer.update(new_value); }
-  T get() const { return reducer.get().value; }
+  T get() const { return reducer.get(); }
 };
 
-template <class T> class Reducer_Vector {
+template <class T> class Reducer_min {
+  Reducer<T, detail::min_op<T>, detail::highest_identity<T>> reducer;
+
+public:
+  Reducer_min() {}
+  void update(T new_value) { reducer.update(new_value); }
+  T get() const { return reducer.get(); }
+};
+
+// get() returns the largest value and its index, if no updates were made the
+// index is std::numeric_limits<Index>::max()
+template <class T, class Index = size_t> class Reducer_argmax {
+  Reducer<std::pair<T, Index>, detail::arg_op<T, Index, true>,
+          detail::arg_identity<T, Index, true>>
+      reducer;
+
+public:
+  Reducer_argmax() {}
+  void update(T new_value, Index index) {
+    reducer.update({new_value, index});
+  }
+  std::pair<T, Index> get() const { return reducer.get(); }
+};
+
+// get() returns the smallest value and its index, if no updates were made the
+// index is std::numeric_limits<Index>::max()
+template <class T, class Index = size_t> class Reducer_argmin {
+  Reducer<std::pair<T, Index>, detail::arg_op<T, Index, false>,
+          detail::arg_identity<T, Index, false>>
+      reducer;
+
+public:
+  Reducer_argmin() {}
+  void update(T new_value, Index index) {
+    reducer.update({new_value, index});
+  }
+  std::pair<T, Index> get() const { return reducer.get(); }
+};
+
+template <class T> class Reducer_bit_and {
+  static_assert(std::is_integral<T>::value, "Integral required.");
+  Reducer<T, std::bit_and<T>, detail::all_ones_identity<T>> reducer;
+
+public:
+  Reducer_bit_and() {}
+  void update(T new_value) { reducer.update(new_value); }
+  T get() const { return reducer.get(); }
+};
+
+template <class T> class Reducer_bit_or {
+  static_assert(std::is_integral<T>::value, "Integral required.");
+  Reducer<T, std::bit_or<T>, detail::zero_identity<T>> reducer;
+
+public:
+  Reducer_bit_or() {}
+  void update(T new_value) { reducer.update(new_value); }
+  T get() const { return reducer.get(); }
+};
+
+template <class T> class Reducer_bit_xor {
+  static_assert(std::is_integral<T>::value, "Integral required.");
+  Reducer<T, std::bit_xor<T>, detail::zero_identity<T>> reducer;
+
+public:
+  Reducer_bit_xor() {}
+  void update(T new_value) { reducer.update(new_value); }
+  T get() const { return reducer.get(); }
+};
+
+// the buffers use default_init_allocator<T> by default so release() does not
+// initialize its output before moving the elements in, pass
+// std::allocator<T> to get plain std::vector<T> buffers
+template <class T, class Allocator = default_init_allocator<T>>
+class Reducer_Vector {
+public:
+  // the type of each buffer and of what release() returns
+  using vector_type = std::vector<T, Allocator>;
+
+private:
 
 #ifdef __cpp_lib_hardware_interference_size
   static constexpr std::size_t hardware_constructive_interference_size =
@@ -131,37 +466,73 @@ template <class T> class Reducer_Vector {
   static constexpr std::size_t hardware_destructive_interference_size = 64;
 #endif
 
+#if CILK_HYPEROBJECTS == 1
+  static void identity_view(void *view) { new (view) vector_type(); }
+  static void reduce_views(void *left, void *right) {
+    auto *l = static_cast<vector_type *>(left);
+    auto *r = static_cast<vector_type *>(right);
+    if (l->empty()) {
+      l->swap(*r);
+    } else {
+      l->insert(l->end(), std::make_move_iterator(r->begin()),
+                std::make_move_iterator(r->end()));
+    }
+    r->~vector_type();
+  }
+  // the views are joined in the serial order, so there is a single buffer
+  // holding the elements in the order the serial program would push them
+  vector_type cilk_reducer(identity_view, reduce_views) view;
+
+  [[nodiscard]] size_t num_slots() const { return 1; }
+  const vector_type &slot([[maybe_unused]] size_t i) const { return view; }
+  vector_type &slot([[maybe_unused]] size_t i) { return view; }
+#else
   struct aligned_f {
 #if PARALLEL == 1
-    alignas(hardware_destructive_interference_size) std::vector<T> f;
+    alignas(hardware_destructive_interference_size) vector_type f;
 #else
-    std::vector<T> f;
+    vector_type f;
 #endif
   };
   std::vector<aligned_f> data;
 
+  [[nodiscard]] size_t num_slots() const { return data.size(); }
+  const vector_type &slot(size_t i) const { return data[i].f; }
+  vector_type &slot(size_t i) { return data[i].f; }
+#endif
+
 public:
-  Reducer_Vector() { data.resize(ParallelTools::getWorkers()); }
-  ~Reducer_Vector() {
-    // if the types are trivially destructable ensure that we don't delete them
-    // one at a time
-    if constexpr (std::is_trivially_destructible_v<T>) {
-      for (auto &vec : data) {
-        typename std::_Vector_base<T, std::allocator<T>>::_Vector_impl
-            *vectorPtr =
-                (typename std::_Vector_base<T, std::allocator<T>>::_Vector_impl
-                     *)((void *)&vec.f);
-        delete vectorPtr->_M_start;
-        vectorPtr->_M_start = vectorPtr->_M_finish =
-            vectorPtr->_M_end_of_storage = nullptr;
-      }
-    }
+#if CILK_HYPEROBJECTS == 1
+  Reducer_Vector() {}
+
+  Reducer_Vector(vector_type &start) { view = std::move(start); }
+  template <class A, class = std::enable_if_t<!std::is_same_v<A, Allocator>>>
+  Reducer_Vector(std::vector<T, A> &start)
+      : view(std::make_move_iterator(start.begin()),
+             std::make_move_iterator(start.end())) {
+    std::vector<T, A>().swap(start);
   }
 
-  Reducer_Vector(std::vector<T> &start) {
+  template <typename F> void push_back(F arg) { view.emplace_back(arg); }
+  void push_back(T arg) { view.push_back(arg); }
+#else
+  Reducer_Vector() { data.resize(ParallelTools::getWorkers()); }
+
+  Reducer_Vector(vector_type &start) {
     data.resize(ParallelTools::getWorkers());
     data[0].f = std::move(start);
   }
+  // a buffer with a different allocator can't be handed over, its elements
+  // are moved over in parallel instead
+  template <class A, class = std::enable_if_t<!std::is_same_v<A, Allocator>>>
+  Reducer_Vector(std::vector<T, A> &start) {
+    data.resize(ParallelTools::getWorkers());
+    data[0].f.resize(start.size());
+    ParallelTools::parallel_for(0, start.size(), [&](size_t i) {
+      data[0].f[i] = std::move(start[i]);
+    });
+    std::vector<T, A>().swap(start);
+  }
 
   template <typename F> void push_back(F arg) {
     int worker_num = getWorkerNum();
@@ -171,41 +542,103 @@ public:
     int worker_num = getWorkerNum();
     data[worker_num].f.push_back(arg);
   }
+#endif
+  // moves all of the elements out, in the order get() would return them, and
+  // leaves the reducer empty.  If only one buffer has elements it is handed
+  // over as is, otherwise the output is sized once and each buffer is moved
+  // into place in parallel and freed as soon as it has been drained.
+  vector_type release() {
+    std::vector<size_t> lengths(num_slots() + 1);
+    size_t non_empty = 0;
+    size_t last_non_empty = 0;
+    for (size_t i = 1; i <= num_slots(); i++) {
+      lengths[i] = lengths[i - 1] + slot(i - 1).size();
+      if (!slot(i - 1).empty()) {
+        non_empty++;
+        last_non_empty = i - 1;
+      }
+    }
+    vector_type output;
+    if (non_empty == 0) {
+      return output;
+    }
+    if (non_empty == 1) {
+      output.swap(slot(last_non_empty));
+      return output;
+    }
+    output.resize(lengths[num_slots()]);
+    ParallelTools::parallel_for(
+        0, num_slots(),
+        [&](size_t i) {
+          vector_type &vec = slot(i);
+          std::move(vec.begin(), vec.end(), output.begin() + lengths[i]);
+          vector_type().swap(vec);
+        },
+        1);
+    return output;
+  }
+
+  // each worker's elements are sorted on their own and then combined with a
+  // single multiway merge
   std::vector<T> get_sorted() const {
-    std::vector<size_t> lengths(data.size() + 1);
-    for (size_t i = 1; i <= data.size(); i++) {
-      lengths[i] += lengths[i - 1] + data[i - 1].f.size();
+    std::vector<size_t> lengths(num_slots() + 1);
+    size_t non_empty = 0;
+    for (size_t i = 1; i <= num_slots(); i++) {
+      lengths[i] += lengths[i - 1] + slot(i - 1).size();
+      non_empty += !slot(i - 1).empty();
     }
-    std::vector<T> output(lengths[data.size()]);
-    if (output.size() > 0) {
-      ParallelTools::parallel_for(0, data.size(), [&](size_t i) {
-        if (data[i].f.size() > 0) {
-          std::memcpy(output.data() + lengths[i], data[i].f.data(),
-                      data[i].f.size() * sizeof(T));
+    std::vector<T> output(lengths[num_slots()]);
+    if (output.empty()) {
+      return output;
+    }
+    if (non_empty == 1) {
+      for (size_t i = 0; i < num_slots(); i++) {
+        if (!slot(i).empty()) {
+          std::memcpy(output.data(), slot(i).data(),
+                      slot(i).size() * sizeof(T));
         }
-      });
+      }
       ParallelTools::sort(output.begin(), output.end());
+      return output;
     }
+    sort_buffer<T> runs(output.size());
+    ParallelTools::parallel_for(
+        0, num_slots(),
+        [&](size_t i) {
+          if (slot(i).size() > 0) {
+            std::memcpy(runs.data() + lengths[i], slot(i).data(),
+                        slot(i).size() * sizeof(T));
+            ParallelTools::sort(runs.data() + lengths[i],
+                                runs.data() + lengths[i + 1]);
+          }
+        },
+        1);
+    std::vector<std::pair<T *, T *>> ranges;
+    for (size_t i = 0; i < num_slots(); i++) {
+      ranges.emplace_back(runs.data() + lengths[i],
+                          runs.data() + lengths[i + 1]);
+    }
+    ParallelTools::multiway_merge(ranges, output.begin());
     return output;
   }
 
   std::vector<T> get() const {
-    if (data.size() == 0) {
+    if (num_slots() == 0) {
       return {};
     }
-    std::vector<size_t> lengths(data.size() + 1);
-    for (size_t i = 1; i <= data.size(); i++) {
-      lengths[i] += lengths[i - 1] + data[i - 1].f.size();
+    std::vector<size_t> lengths(num_slots() + 1);
+    for (size_t i = 1; i <= num_slots(); i++) {
+      lengths[i] += lengths[i - 1] + slot(i - 1).size();
     }
-    if (lengths[data.size()] == 0) {
+    if (lengths[num_slots()] == 0) {
       return {};
     }
-    std::vector<T> output(lengths[data.size()]);
+    std::vector<T> output(lengths[num_slots()]);
     if (output.size() > 0) {
-      ParallelTools::parallel_for(0, data.size(), [&](size_t i) {
-        if (data[i].f.size() > 0) {
-          std::memcpy(output.data() + lengths[i], data[i].f.data(),
-                      data[i].f.size() * sizeof(T));
+      ParallelTools::parallel_for(0, num_slots(), [&](size_t i) {
+        if (slot(i).size() > 0) {
+          std::memcpy(output.data() + lengths[i], slot(i).data(),
+                      slot(i).size() * sizeof(T));
         }
       });
     }
@@ -213,25 +646,27 @@ public:
   }
 
   template <typename F> void for_each(F f) const {
-    ParallelTools::parallel_for(0, data.size(), [&](size_t i) {
-      ParallelTools::parallel_for(0, data[i].f.size(),
-                                  [&](size_t j) { f(data[i].f[j]); });
+    ParallelTools::parallel_for(0, num_slots(), [&](size_t i) {
+      const auto &vec = slot(i);
+      ParallelTools::parallel_for(0, vec.size(), [&](size_t j) { f(vec[j]); });
     });
   }
   template <typename F> void serial_for_each(F f) const {
-    for (auto &d : data) {
-      for (auto &e : d.f) {
+    for (size_t i = 0; i < num_slots(); i++) {
+      for (auto &e : slot(i)) {
         f(e);
       }
     }
   }
   template <typename C, typename R, typename K>
   K find_first_match(C c, R r, K default_return) {
-    for (auto &d : data) {
-      for (auto &e : d.f) {
-        if (c(e)) {
-          return r(e);
-        }
+    // each buffer is searched in parallel, one buffer at a time so the match
+    // found is the same one the serial order would find
+    for (size_t i = 0; i < num_slots(); i++) {
+      const auto &vec = slot(i);
+      auto it = ParallelTools::parallel_find_if(vec.begin(), vec.end(), c);
+      if (it != vec.end()) {
+        return r(*it);
       }
     }
     return default_return;
@@ -239,14 +674,353 @@ public:
 
   size_t size() const {
     size_t n = 0;
-    for (auto &d : data) {
-      n += d.f.size();
+    for (size_t i = 0; i < num_slots(); i++) {
+      n += slot(i).size();
     }
     return n;
   }
   bool empty() const {
+    for (size_t i = 0; i < num_slots(); i++) {
+      if (!slot(i).empty()) {
+        return false;
+      }
+    }
+    return true;
+  }
+};
+
+// a read only window over storage made of several contiguous segments, seen
+// as a single sequence in segment order.  Nothing is copied, so it is only
+// valid until the storage it came from is changed.
+template <class T> class segmented_view {
+  std::vector<T *> starts;
+  // offsets[s] is the position of the first element of segment s
+  std::vector<size_t> offsets = {0};
+
+  // the segment holding position pos, num_segments() for the end
+  [[nodiscard]] size_t segment_of(size_t pos) const {
+    return std::upper_bound(offsets.begin() + 1, offsets.end(), pos) -
+           (offsets.begin() + 1);
+  }
+
+public:
+  class iterator {
+    const segmented_view *view = nullptr;
+    size_t segment = 0;
+    size_t pos = 0;
+
+  public:
+    using iterator_category = std::random_access_iterator_tag;
+    using value_type = std::remove_cv_t<T>;
+    using difference_type = std::ptrdiff_t;
+    using pointer = T *;
+    using reference = T &;
+
+    iterator() = default;
+    iterator(const segmented_view *view_, size_t pos_)
+        : view(view_), segment(view_->segment_of(pos_)), pos(pos_) {}
+
+    reference operator*() const {
+      return view->starts[segment][pos - view->offsets[segment]];
+    }
+    pointer operator->() const { return &**this; }
+    reference operator[](difference_type n) const { return *(*this + n); }
+
+    iterator &operator++() {
+      pos++;
+      if (pos == view->offsets[segment + 1]) {
+        segment++;
+      }
+      return *this;
+    }
+    iterator operator++(int) {
+      iterator old = *this;
+      ++*this;
+      return old;
+    }
+    iterator &operator--() {
+      if (pos == view->offsets[segment]) {
+        segment--;
+      }
+      pos--;
+      return *this;
+    }
+    iterator operator--(int) {
+      iterator old = *this;
+      --*this;
+      return old;
+    }
+    iterator &operator+=(difference_type n) {
+      pos += n;
+      segment = view->segment_of(pos);
+      return *this;
+    }
+    iterator &operator-=(difference_type n) { return *this += -n; }
+    friend iterator operator+(iterator it, difference_type n) {
+      return it += n;
+    }
+    friend iterator operator+(difference_type n, iterator it) {
+      return it += n;
+    }
+    friend iterator operator-(iterator it, difference_type n) {
+      return it -= n;
+    }
+    friend difference_type operator-(const iterator &a, const iterator &b) {
+      return static_cast<difference_type>(a.pos) -
+             static_cast<difference_type>(b.pos);
+    }
+    friend bool operator==(const iterator &a, const iterator &b) {
+      return a.pos == b.pos;
+    }
+    friend bool operator!=(const iterator &a, const iterator &b) {
+      return a.pos != b.pos;
+    }
+    friend bool operator<(const iterator &a, const iterator &b) {
+      return a.pos < b.pos;
+    }
+    friend bool operator>(const iterator &a, const iterator &b) {
+      return a.pos > b.pos;
+    }
+    friend bool operator<=(const iterator &a, const iterator &b) {
+      return a.pos <= b.pos;
+    }
+    friend bool operator>=(const iterator &a, const iterator &b) {
+      return a.pos >= b.pos;
+    }
+  };
+
+  segmented_view() = default;
+
+  // empty segments are dropped
+  void add_segment(T *start, size_t length) {
+    if (length > 0) {
+      starts.push_back(start);
+      offsets.push_back(offsets.back() + length);
+    }
+  }
+
+  [[nodiscard]] size_t size() const { return offsets.back(); }
+  [[nodiscard]] bool empty() const { return size() == 0; }
+  [[nodiscard]] size_t num_segments() const { return starts.size(); }
+  // the elements of segment s are [segment_begin(s), segment_end(s))
+  T *segment_begin(size_t s) const { return starts[s]; }
+  T *segment_end(size_t s) const {
+    return starts[s] + (offsets[s + 1] - offsets[s]);
+  }
+
+  iterator begin() const { return iterator(this, 0); }
+  iterator end() const { return iterator(this, size()); }
+  T &operator[](size_t i) const {
+    size_t s = segment_of(i);
+    return starts[s][i - offsets[s]];
+  }
+
+  // f(element) for every element, in parallel
+  template <typename F> void for_each(F f) const {
+    ParallelTools::parallel_for(
+        0, num_segments(),
+        [&](size_t s) {
+          for (T *it = segment_begin(s); it != segment_end(s); ++it) {
+            f(*it);
+          }
+        },
+        1);
+  }
+  template <typename F> void serial_for_each(F f) const {
+    for (size_t s = 0; s < num_segments(); s++) {
+      for (T *it = segment_begin(s); it != segment_end(s); ++it) {
+        f(*it);
+      }
+    }
+  }
+
+  // copies every element to [d_first, d_first + size()) in parallel
+  template <class RandomIt> RandomIt copy_to(RandomIt d_first) const {
+    ParallelTools::parallel_for(
+        0, num_segments(),
+        [&](size_t s) {
+          std::copy(segment_begin(s), segment_end(s), d_first + offsets[s]);
+        },
+        1);
+    return d_first + size();
+  }
+};
+
+// like Reducer_Vector, but each worker appends to a list of fixed size blocks
+// so a push_back never moves what has already been pushed.  Blocks released
+// by clear() stay in the pool of the worker that owned them and are reused
+// before any new ones are allocated.
+// view() reads the results in place, get() is the only thing which flattens
+// them into one vector.
+template <class T,
+          size_t block_size = std::max<size_t>(1, (1UL << 14U) / sizeof(T))>
+class Reducer_Block_Vector {
+
+#ifdef __cpp_lib_hardware_interference_size
+  static constexpr std::size_t hardware_constructive_interference_size =
+      std::hardware_constructive_interference_size;
+  static constexpr std::size_t hardware_destructive_interference_size =
+      std::hardware_destructive_interference_size;
+#else
+  // 64 bytes on x86-64 │ L1_CACHE_BYTES │ L1_CACHE_SHIFT │ __cacheline_aligned
+  // │
+  // ...
+  static constexpr std::size_t hardware_constructive_interference_size = 64;
+  static constexpr std::size_t hardware_destructive_interference_size = 64;
+#endif
+
+  struct block {
+    block *next = nullptr;
+    size_t size = 0;
+    alignas(T) unsigned char storage[sizeof(T) * block_size];
+
+    T *data() { return std::launder(reinterpret_cast<T *>(storage)); }
+  };
+
+  struct worker_blocks {
+    block *head = nullptr;
+    block *tail = nullptr;
+    // blocks to use before allocating new ones
+    block *pool = nullptr;
+  };
+
+  struct aligned_f {
+#if PARALLEL == 1
+    alignas(hardware_destructive_interference_size) worker_blocks f;
+#else
+    worker_blocks f;
+#endif
+  };
+  std::vector<aligned_f> data;
+
+#if CILK == 1
+  // so cilksan doesn't report races on accesses to the vector which I make sure
+  // are fine by using getWorkerNum()
+  Cilksan_fake_mutex fake_lock;
+#endif
+
+  // the block the next element of this worker goes in
+  block *next_block(worker_blocks &w) {
+    if (w.tail != nullptr && w.tail->size < block_size) {
+      return w.tail;
+    }
+    block *b = w.pool;
+    if (b != nullptr) {
+      w.pool = b->next;
+      b->next = nullptr;
+    } else {
+      b = new block;
+    }
+    if (w.tail == nullptr) {
+      w.head = b;
+    } else {
+      w.tail->next = b;
+    }
+    w.tail = b;
+    return b;
+  }
+
+  static void destroy_elements(block *b) {
+    if constexpr (!std::is_trivially_destructible_v<T>) {
+      for (size_t i = 0; i < b->size; i++) {
+        b->data()[i].~T();
+      }
+    }
+    b->size = 0;
+  }
+
+  template <class View> View make_view() const {
+    View view;
+    for (const auto &d : data) {
+      for (block *b = d.f.head; b != nullptr; b = b->next) {
+        view.add_segment(b->data(), b->size);
+      }
+    }
+    return view;
+  }
+
+public:
+  Reducer_Block_Vector() { data.resize(ParallelTools::getWorkers()); }
+  ~Reducer_Block_Vector() {
+    clear();
     for (auto &d : data) {
-      if (!d.f.empty()) {
+      while (d.f.pool != nullptr) {
+        block *b = d.f.pool;
+        d.f.pool = b->next;
+        delete b;
+      }
+    }
+  }
+  Reducer_Block_Vector(const Reducer_Block_Vector &) = delete;
+  Reducer_Block_Vector &operator=(const Reducer_Block_Vector &) = delete;
+
+  template <class... Args> void emplace_back(Args &&...args) {
+    int worker_num = getWorkerNum();
+#if CILK == 1
+    Cilksan_fake_lock_guard guad(&fake_lock);
+#endif
+    block *b = next_block(data[worker_num].f);
+    new (b->data() + b->size) T(std::forward<Args>(args)...);
+    b->size++;
+  }
+  void push_back(const T &arg) { emplace_back(arg); }
+  void push_back(T &&arg) { emplace_back(std::move(arg)); }
+
+  // destroys the elements and keeps their blocks for later pushes
+  void clear() {
+    ParallelTools::parallel_for(
+        0, data.size(),
+        [&](size_t i) {
+          worker_blocks &w = data[i].f;
+          for (block *b = w.head; b != nullptr; b = b->next) {
+            destroy_elements(b);
+          }
+          if (w.tail != nullptr) {
+            w.tail->next = w.pool;
+            w.pool = w.head;
+          }
+          w.head = w.tail = nullptr;
+        },
+        1);
+  }
+
+  // the elements in place, each worker's elements in the order it pushed
+  // them and the workers one after another, like get() would order them
+  segmented_view<T> view() { return make_view<segmented_view<T>>(); }
+  segmented_view<const T> view() const {
+    return make_view<segmented_view<const T>>();
+  }
+
+  // flattens everything into one vector
+  std::vector<T> get() const {
+    auto v = view();
+    std::vector<T> output(v.size());
+    v.copy_to(output.begin());
+    return output;
+  }
+  std::vector<T> get_sorted() const {
+    std::vector<T> output = get();
+    ParallelTools::sort(output.begin(), output.end());
+    return output;
+  }
+
+  template <typename F> void for_each(F f) const { view().for_each(f); }
+  template <typename F> void serial_for_each(F f) const {
+    view().serial_for_each(f);
+  }
+
+  size_t size() const {
+    size_t n = 0;
+    for (const auto &d : data) {
+      for (block *b = d.f.head; b != nullptr; b = b->next) {
+        n += b->size;
+      }
+    }
+    return n;
+  }
+  bool empty() const {
+    for (const auto &d : data) {
+      if (d.f.head != nullptr) {
         return false;
       }
     }
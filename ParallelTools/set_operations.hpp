@@ -0,0 +1,269 @@
+#pragma once
+
+#include "parallel.h"
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <iterator>
+#include <type_traits>
+#include <vector>
+
+namespace ParallelTools {
+
+namespace detail {
+
+enum class set_operation {
+  Union,
+  Intersection,
+  Difference,
+  SymmetricDifference
+};
+
+// an output iterator which only counts what is written to it
+class counting_output_iterator {
+  size_t count_ = 0;
+
+  struct ignore {
+    template <class T> ignore &operator=(const T &) { return *this; }
+  };
+
+public:
+  using iterator_category = std::output_iterator_tag;
+  using value_type = void;
+  using difference_type = std::ptrdiff_t;
+  using pointer = void;
+  using reference = void;
+
+  ignore operator*() { return {}; }
+  counting_output_iterator &operator++() {
+    count_++;
+    return *this;
+  }
+  counting_output_iterator operator++(int) {
+    counting_output_iterator old = *this;
+    count_++;
+    return old;
+  }
+  [[nodiscard]] size_t count() const { return count_; }
+};
+
+// std::lower_bound, but searching outwards from first so finding a nearby
+// position is only logarithmic in the distance to it
+template <class It, class T, class Compare>
+It gallop_lower_bound(It first, It last, const T &value, Compare comp) {
+  size_t n = last - first;
+  size_t before = 0;
+  size_t step = 1;
+  // everything in [first, first + before) is less than value
+  while (before + step <= n && comp(first[before + step - 1], value)) {
+    before += step;
+    step *= 2;
+  }
+  return std::lower_bound(first + before, first + std::min(n, before + step),
+                          value, comp);
+}
+
+// walks the smaller range and gallops through the larger one
+// the multiset semantics and which range equal elements are taken from match
+// the std:: versions
+template <set_operation op, class It1, class It2, class OutputIt,
+          class Compare>
+OutputIt galloping_set_operation(It1 first1, It1 last1, It2 first2, It2 last2,
+                                 OutputIt d_first, Compare comp) {
+  bool walk_first = (last1 - first1) <= (last2 - first2);
+  if (walk_first) {
+    for (; first1 != last1; ++first1) {
+      It2 next2 = gallop_lower_bound(first2, last2, *first1, comp);
+      if constexpr (op == set_operation::Union ||
+                    op == set_operation::SymmetricDifference) {
+        d_first = std::copy(first2, next2, d_first);
+      }
+      first2 = next2;
+      bool match = first2 != last2 && !comp(*first1, *first2);
+      if (match) {
+        ++first2;
+      }
+      if constexpr (op == set_operation::Union) {
+        *d_first++ = *first1;
+      } else if constexpr (op == set_operation::Intersection) {
+        if (match) {
+          *d_first++ = *first1;
+        }
+      } else {
+        if (!match) {
+          *d_first++ = *first1;
+        }
+      }
+    }
+    if constexpr (op == set_operation::Union ||
+                  op == set_operation::SymmetricDifference) {
+      d_first = std::copy(first2, last2, d_first);
+    }
+  } else {
+    for (; first2 != last2; ++first2) {
+      It1 next1 = gallop_lower_bound(first1, last1, *first2, comp);
+      if constexpr (op != set_operation::Intersection) {
+        d_first = std::copy(first1, next1, d_first);
+      }
+      first1 = next1;
+      bool match = first1 != last1 && !comp(*first2, *first1);
+      if constexpr (op == set_operation::Union) {
+        *d_first++ = match ? *first1 : *first2;
+      } else if constexpr (op == set_operation::Intersection) {
+        if (match) {
+          *d_first++ = *first1;
+        }
+      } else if constexpr (op == set_operation::SymmetricDifference) {
+        if (!match) {
+          *d_first++ = *first2;
+        }
+      }
+      if (match) {
+        ++first1;
+      }
+    }
+    if constexpr (op != set_operation::Intersection) {
+      d_first = std::copy(first1, last1, d_first);
+    }
+  }
+  return d_first;
+}
+
+// when one range is this many times larger than the other it is galloped
+// through instead of walked
+static constexpr size_t set_operation_gallop_ratio = 32;
+static constexpr size_t set_operation_serial_cutoff = 1UL << 14U;
+
+template <set_operation op, class It1, class It2, class OutputIt,
+          class Compare>
+OutputIt serial_set_operation(It1 first1, It1 last1, It2 first2, It2 last2,
+                              OutputIt d_first, Compare comp) {
+  size_t n1 = last1 - first1;
+  size_t n2 = last2 - first2;
+  if (std::min(n1, n2) * set_operation_gallop_ratio < std::max(n1, n2)) {
+    return galloping_set_operation<op>(first1, last1, first2, last2, d_first,
+                                       comp);
+  }
+  if constexpr (op == set_operation::Union) {
+    return std::set_union(first1, last1, first2, last2, d_first, comp);
+  } else if constexpr (op == set_operation::Intersection) {
+    return std::set_intersection(first1, last1, first2, last2, d_first, comp);
+  } else if constexpr (op == set_operation::Difference) {
+    return std::set_difference(first1, last1, first2, last2, d_first, comp);
+  } else {
+    return std::set_symmetric_difference(first1, last1, first2, last2,
+                                         d_first, comp);
+  }
+}
+
+// the ranges are cut into pieces so that all copies of a value fall in the
+// same piece of both ranges, the same split merge uses but made at value
+// boundaries.  Each piece is run once to count its output, the counts are
+// scanned, and each piece is run again writing directly to its final place.
+template <set_operation op, class It1, class It2, class OutputIt,
+          class Compare>
+OutputIt indexed_set_operation(It1 first1, It1 last1, It2 first2, It2 last2,
+                               OutputIt d_first, Compare comp) {
+  size_t n1 = last1 - first1;
+  size_t n2 = last2 - first2;
+  size_t num_pieces = std::min((n1 + n2) / set_operation_serial_cutoff,
+                               static_cast<size_t>(getWorkers()) * 4);
+  if (PARALLEL == 0 || num_pieces <= 1) {
+    return serial_set_operation<op>(first1, last1, first2, last2, d_first,
+                                    comp);
+  }
+  std::vector<size_t> splits1(num_pieces + 1);
+  std::vector<size_t> splits2(num_pieces + 1);
+  splits1[num_pieces] = n1;
+  splits2[num_pieces] = n2;
+  ParallelTools::parallel_for(1, num_pieces, [&](size_t i) {
+    if (n1 >= n2) {
+      It1 split = first1 + (i * n1 / num_pieces);
+      splits1[i] = std::lower_bound(first1, split, *split, comp) - first1;
+      splits2[i] = std::lower_bound(first2, last2, *split, comp) - first2;
+    } else {
+      It2 split = first2 + (i * n2 / num_pieces);
+      splits2[i] = std::lower_bound(first2, split, *split, comp) - first2;
+      splits1[i] = std::lower_bound(first1, last1, *split, comp) - first1;
+    }
+  });
+  std::vector<size_t> offsets(num_pieces + 1);
+  ParallelTools::parallel_for(
+      0, num_pieces,
+      [&](size_t i) {
+        offsets[i + 1] =
+            serial_set_operation<op>(
+                first1 + splits1[i], first1 + splits1[i + 1],
+                first2 + splits2[i], first2 + splits2[i + 1],
+                counting_output_iterator(), comp)
+                .count();
+      },
+      1);
+  for (size_t i = 0; i < num_pieces; i++) {
+    offsets[i + 1] += offsets[i];
+  }
+  ParallelTools::parallel_for(
+      0, num_pieces,
+      [&](size_t i) {
+        serial_set_operation<op>(first1 + splits1[i], first1 + splits1[i + 1],
+                                 first2 + splits2[i], first2 + splits2[i + 1],
+                                 d_first + offsets[i], comp);
+      },
+      1);
+  return d_first + offsets[num_pieces];
+}
+
+template <set_operation op, class It1, class It2, class OutputIt,
+          class Compare>
+OutputIt parallel_set_operation(It1 first1, It1 last1, It2 first2, It2 last2,
+                                OutputIt d_first, Compare comp) {
+  // the pieces can only be written in parallel if the output can be indexed
+  using output_category =
+      typename std::iterator_traits<OutputIt>::iterator_category;
+  if constexpr (!std::is_base_of_v<std::random_access_iterator_tag,
+                                   output_category>) {
+    return serial_set_operation<op>(first1, last1, first2, last2, d_first,
+                                    comp);
+  } else {
+    return indexed_set_operation<op>(first1, last1, first2, last2, d_first,
+                                     comp);
+  }
+}
+
+} // namespace detail
+
+// parallel versions of the std:: sorted range set operations with the same
+// multiset semantics, the output is compacted and the end of it is returned
+// when one range is much smaller than the other the larger range is galloped
+// through instead of walked
+template <class It1, class It2, class OutputIt, class Compare = std::less<>>
+OutputIt set_union(It1 first1, It1 last1, It2 first2, It2 last2,
+                   OutputIt d_first, Compare comp = std::less<>()) {
+  return detail::parallel_set_operation<detail::set_operation::Union>(
+      first1, last1, first2, last2, d_first, comp);
+}
+
+template <class It1, class It2, class OutputIt, class Compare = std::less<>>
+OutputIt set_intersection(It1 first1, It1 last1, It2 first2, It2 last2,
+                          OutputIt d_first, Compare comp = std::less<>()) {
+  return detail::parallel_set_operation<detail::set_operation::Intersection>(
+      first1, last1, first2, last2, d_first, comp);
+}
+
+template <class It1, class It2, class OutputIt, class Compare = std::less<>>
+OutputIt set_difference(It1 first1, It1 last1, It2 first2, It2 last2,
+                        OutputIt d_first, Compare comp = std::less<>()) {
+  return detail::parallel_set_operation<detail::set_operation::Difference>(
+      first1, last1, first2, last2, d_first, comp);
+}
+
+template <class It1, class It2, class OutputIt, class Compare = std::less<>>
+OutputIt set_symmetric_difference(It1 first1, It1 last1, It2 first2,
+                                  It2 last2, OutputIt d_first,
+                                  Compare comp = std::less<>()) {
+  return detail::parallel_set_operation<
+      detail::set_operation::SymmetricDifference>(first1, last1, first2, last2,
+                                                  d_first, comp);
+}
+
+} // namespace ParallelTools
@@ -0,0 +1,559 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <type_traits>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define SIMD_SORT_AVX2 1
+#include <immintrin.h>
+#else
+#define SIMD_SORT_AVX2 0
+#endif
+
+namespace ParallelTools {
+
+// the key types which have a vectorized sorting network and merge kernel
+// floating point keys must not be NaN
+template <class T>
+struct is_simd_sortable
+    : std::bool_constant<
+          std::is_same_v<T, int32_t> || std::is_same_v<T, uint32_t> ||
+          std::is_same_v<T, int64_t> || std::is_same_v<T, uint64_t> ||
+          std::is_same_v<T, float> || std::is_same_v<T, double>> {};
+
+namespace detail {
+
+#if SIMD_SORT_AVX2 == 1
+
+#define SIMD_SORT_TARGET __attribute__((target("avx2")))
+
+[[maybe_unused]] static bool has_avx2() {
+  static const bool supported = __builtin_cpu_supports("avx2");
+  return supported;
+}
+
+[[maybe_unused]] static bool has_avx512() {
+  static const bool supported = __builtin_cpu_supports("avx512f");
+  return supported;
+}
+
+// a lane mask which is all ones where a < b, for each key type
+// the kernels only ever choose between their inputs with this mask instead of
+// computing min and max, since min and max of -0.0 and 0.0 both return the
+// same operand and would lose one of them
+template <class T> struct avx2_ops;
+
+template <> struct avx2_ops<int32_t> {
+  SIMD_SORT_TARGET static __m256i less(__m256i a, __m256i b) {
+    return _mm256_cmpgt_epi32(b, a);
+  }
+};
+
+template <> struct avx2_ops<uint32_t> {
+  SIMD_SORT_TARGET static __m256i less(__m256i a, __m256i b) {
+    const __m256i sign = _mm256_set1_epi32(INT32_MIN);
+    return _mm256_cmpgt_epi32(_mm256_xor_si256(b, sign),
+                              _mm256_xor_si256(a, sign));
+  }
+};
+
+template <> struct avx2_ops<float> {
+  SIMD_SORT_TARGET static __m256i less(__m256i a, __m256i b) {
+    return _mm256_castps_si256(_mm256_cmp_ps(
+        _mm256_castsi256_ps(a), _mm256_castsi256_ps(b), _CMP_LT_OQ));
+  }
+};
+
+template <> struct avx2_ops<int64_t> {
+  SIMD_SORT_TARGET static __m256i less(__m256i a, __m256i b) {
+    return _mm256_cmpgt_epi64(b, a);
+  }
+};
+
+template <> struct avx2_ops<uint64_t> {
+  SIMD_SORT_TARGET static __m256i less(__m256i a, __m256i b) {
+    const __m256i sign = _mm256_set1_epi64x(INT64_MIN);
+    return _mm256_cmpgt_epi64(_mm256_xor_si256(b, sign),
+                              _mm256_xor_si256(a, sign));
+  }
+};
+
+template <> struct avx2_ops<double> {
+  SIMD_SORT_TARGET static __m256i less(__m256i a, __m256i b) {
+    return _mm256_castpd_si256(_mm256_cmp_pd(
+        _mm256_castsi256_pd(a), _mm256_castsi256_pd(b), _CMP_LT_OQ));
+  }
+};
+
+// one step of a bitonic network over the lanes of a single register
+// everything is expressed on 32 bit pieces so that one permute instruction
+// works for every key size, a register has 8 pieces with avx2 and 16 with
+// avx512
+template <size_t pieces> struct bitonic_step_table {
+  std::array<int32_t, pieces> permute{};
+  // all ones in the pieces of lanes which keep the max
+  std::array<int32_t, pieces> take_max{};
+  // the same as a bit for each lane
+  uint32_t take_max_lanes = 0;
+};
+
+// compares each lane with the lane distance away, blocks of block lanes
+// alternate between ascending and descending
+template <size_t pieces, size_t lanes>
+constexpr bitonic_step_table<pieces> make_bitonic_step(size_t block,
+                                                       size_t distance) {
+  constexpr size_t lane_pieces = pieces / lanes;
+  bitonic_step_table<pieces> s;
+  for (size_t i = 0; i < lanes; i++) {
+    bool upper = (i & distance) != 0;
+    bool descending = (i & block) != 0;
+    for (size_t p = 0; p < lane_pieces; p++) {
+      s.permute[i * lane_pieces + p] =
+          static_cast<int32_t>((i ^ distance) * lane_pieces + p);
+      s.take_max[i * lane_pieces + p] = (upper != descending) ? -1 : 0;
+    }
+    if (upper != descending) {
+      s.take_max_lanes |= 1U << i;
+    }
+  }
+  return s;
+}
+
+template <size_t lanes>
+constexpr size_t log2_lanes = (lanes == 16) ? 4 : (lanes == 8) ? 3 : 2;
+
+// the full sorting network
+template <size_t pieces, size_t lanes>
+constexpr std::array<bitonic_step_table<pieces>,
+                     log2_lanes<lanes> * (log2_lanes<lanes> + 1) / 2>
+make_bitonic_sort() {
+  std::array<bitonic_step_table<pieces>,
+             log2_lanes<lanes> * (log2_lanes<lanes> + 1) / 2>
+      steps{};
+  size_t k = 0;
+  for (size_t block = 2; block <= lanes; block *= 2) {
+    for (size_t distance = block / 2; distance > 0; distance /= 2) {
+      steps[k++] = make_bitonic_step<pieces, lanes>(block, distance);
+    }
+  }
+  return steps;
+}
+
+// sorts a bitonic sequence
+template <size_t pieces, size_t lanes>
+constexpr std::array<bitonic_step_table<pieces>, log2_lanes<lanes>>
+make_bitonic_clean() {
+  std::array<bitonic_step_table<pieces>, log2_lanes<lanes>> steps{};
+  size_t k = 0;
+  for (size_t distance = lanes / 2; distance > 0; distance /= 2) {
+    steps[k++] = make_bitonic_step<pieces, lanes>(0, distance);
+  }
+  return steps;
+}
+
+template <size_t pieces, size_t lanes>
+constexpr std::array<int32_t, pieces> make_reverse() {
+  constexpr size_t lane_pieces = pieces / lanes;
+  std::array<int32_t, pieces> permute{};
+  for (size_t i = 0; i < lanes; i++) {
+    for (size_t p = 0; p < lane_pieces; p++) {
+      permute[i * lane_pieces + p] =
+          static_cast<int32_t>((lanes - 1 - i) * lane_pieces + p);
+    }
+  }
+  return permute;
+}
+
+template <size_t pieces, size_t lanes>
+inline constexpr auto bitonic_sort_steps = make_bitonic_sort<pieces, lanes>();
+template <size_t pieces, size_t lanes>
+inline constexpr auto bitonic_clean_steps =
+    make_bitonic_clean<pieces, lanes>();
+template <size_t pieces, size_t lanes>
+inline constexpr auto reverse_lanes = make_reverse<pieces, lanes>();
+
+template <class T>
+SIMD_SORT_TARGET inline __m256i bitonic_step(__m256i v,
+                                             const bitonic_step_table<8> &s) {
+  __m256i partner = _mm256_permutevar8x32_epi32(
+      v,
+      _mm256_loadu_si256(reinterpret_cast<const __m256i *>(s.permute.data())));
+  __m256i take_max =
+      _mm256_loadu_si256(reinterpret_cast<const __m256i *>(s.take_max.data()));
+  // both lanes of a pair make the same decision, so equal keys are never
+  // duplicated
+  __m256i swap = _mm256_blendv_epi8(avx2_ops<T>::less(partner, v),
+                                    avx2_ops<T>::less(v, partner), take_max);
+  return _mm256_blendv_epi8(v, partner, swap);
+}
+
+template <class T> SIMD_SORT_TARGET inline __m256i sort_register(__m256i v) {
+  for (const auto &s : bitonic_sort_steps<8, 32 / sizeof(T)>) {
+    v = bitonic_step<T>(v, s);
+  }
+  return v;
+}
+
+// a and b are each sorted, afterwards a holds the smallest half of both in
+// order and b the largest half
+template <class T>
+SIMD_SORT_TARGET inline void merge_registers(__m256i &a, __m256i &b) {
+  constexpr size_t lanes = 32 / sizeof(T);
+  b = _mm256_permutevar8x32_epi32(
+      b, _mm256_loadu_si256(reinterpret_cast<const __m256i *>(
+             reverse_lanes<8, lanes>.data())));
+  __m256i swap = avx2_ops<T>::less(b, a);
+  __m256i low = _mm256_blendv_epi8(a, b, swap);
+  __m256i high = _mm256_blendv_epi8(b, a, swap);
+  for (const auto &s : bitonic_clean_steps<8, lanes>) {
+    low = bitonic_step<T>(low, s);
+    high = bitonic_step<T>(high, s);
+  }
+  a = low;
+  b = high;
+}
+
+template <class T> SIMD_SORT_TARGET inline __m256i load(const T *p) {
+  return _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+}
+
+template <class T> SIMD_SORT_TARGET inline void store(T *p, __m256i v) {
+  _mm256_storeu_si256(reinterpret_cast<__m256i *>(p), v);
+}
+
+// merges two sorted runs a register at a time, the register holding the
+// largest keys seen so far is merged with the next register from whichever
+// run has the smaller next key
+template <class T>
+SIMD_SORT_TARGET void avx2_merge(const T *first1, const T *last1,
+                                 const T *first2, const T *last2, T *out) {
+  constexpr size_t lanes = 32 / sizeof(T);
+  if (static_cast<size_t>(last1 - first1) < lanes ||
+      static_cast<size_t>(last2 - first2) < lanes) {
+    std::merge(first1, last1, first2, last2, out);
+    return;
+  }
+  __m256i low = load(first1);
+  __m256i high = load(first2);
+  first1 += lanes;
+  first2 += lanes;
+  merge_registers<T>(low, high);
+  store(out, low);
+  out += lanes;
+  while (true) {
+    bool from_first =
+        first2 == last2 || (first1 != last1 && !(*first2 < *first1));
+    const T *&next = from_first ? first1 : first2;
+    const T *next_last = from_first ? last1 : last2;
+    if (static_cast<size_t>(next_last - next) < lanes) {
+      break;
+    }
+    low = load(next);
+    next += lanes;
+    merge_registers<T>(low, high);
+    store(out, low);
+    out += lanes;
+  }
+  // what is left is the high register and less than a register from at least
+  // one of the runs
+  T kept[lanes];
+  store(kept, high);
+  T small[2 * lanes];
+  bool first_short = static_cast<size_t>(last1 - first1) < lanes;
+  const T *short_first = first_short ? first1 : first2;
+  const T *short_last = first_short ? last1 : last2;
+  T *small_last =
+      std::merge(kept, kept + lanes, short_first, short_last, small);
+  if (first_short) {
+    std::merge(small, small_last, first2, last2, out);
+  } else {
+    std::merge(small, small_last, first1, last1, out);
+  }
+}
+
+// sorts each register with the sorting network and then merges runs bottom
+// up with the merge kernel
+// scratch needs space for n elements, if it is null a buffer is allocated
+template <class T>
+SIMD_SORT_TARGET void avx2_sort(T *data, size_t n, T *scratch) {
+  constexpr size_t lanes = 32 / sizeof(T);
+  if (n < 4 * lanes) {
+    std::sort(data, data + n);
+    return;
+  }
+  size_t full = n - (n % lanes);
+  for (size_t i = 0; i < full; i += lanes) {
+    store(data + i, sort_register<T>(load(data + i)));
+  }
+  std::sort(data + full, data + n);
+
+  std::unique_ptr<T[]> buffer;
+  if (scratch == nullptr) {
+    buffer.reset(new T[n]);
+    scratch = buffer.get();
+  }
+  T *src = data;
+  T *dest = scratch;
+  for (size_t width = lanes; width < n; width *= 2) {
+    for (size_t start = 0; start < n; start += 2 * width) {
+      size_t mid = std::min(start + width, n);
+      size_t end = std::min(start + 2 * width, n);
+      avx2_merge<T>(src + start, src + mid, src + mid, src + end,
+                    dest + start);
+    }
+    std::swap(src, dest);
+  }
+  if (src != data) {
+    std::memcpy(data, src, n * sizeof(T));
+  }
+}
+
+#undef SIMD_SORT_TARGET
+
+// the same kernels on 512 bit registers, where comparisons give a bit mask for
+// each lane instead of a vector.  The merge and sort drivers are repeated
+// rather than shared with avx2 since gcc and clang will not inline functions
+// compiled for a target into a template which is not
+#define SIMD_SORT_TARGET __attribute__((target("avx512f")))
+
+template <class T>
+using avx512_mask = std::conditional_t<sizeof(T) == 4, __mmask16, __mmask8>;
+
+template <class T> struct avx512_ops;
+
+template <> struct avx512_ops<int32_t> {
+  SIMD_SORT_TARGET static __mmask16 less(__m512i a, __m512i b) {
+    return _mm512_cmplt_epi32_mask(a, b);
+  }
+};
+
+template <> struct avx512_ops<uint32_t> {
+  SIMD_SORT_TARGET static __mmask16 less(__m512i a, __m512i b) {
+    return _mm512_cmplt_epu32_mask(a, b);
+  }
+};
+
+template <> struct avx512_ops<float> {
+  SIMD_SORT_TARGET static __mmask16 less(__m512i a, __m512i b) {
+    return _mm512_cmp_ps_mask(_mm512_castsi512_ps(a), _mm512_castsi512_ps(b),
+                              _CMP_LT_OQ);
+  }
+};
+
+template <> struct avx512_ops<int64_t> {
+  SIMD_SORT_TARGET static __mmask8 less(__m512i a, __m512i b) {
+    return _mm512_cmplt_epi64_mask(a, b);
+  }
+};
+
+template <> struct avx512_ops<uint64_t> {
+  SIMD_SORT_TARGET static __mmask8 less(__m512i a, __m512i b) {
+    return _mm512_cmplt_epu64_mask(a, b);
+  }
+};
+
+template <> struct avx512_ops<double> {
+  SIMD_SORT_TARGET static __mmask8 less(__m512i a, __m512i b) {
+    return _mm512_cmp_pd_mask(_mm512_castsi512_pd(a), _mm512_castsi512_pd(b),
+                              _CMP_LT_OQ);
+  }
+};
+
+// the lanes of b where m is set and of a elsewhere
+template <class T>
+SIMD_SORT_TARGET inline __m512i avx512_blend(avx512_mask<T> m, __m512i a,
+                                             __m512i b) {
+  if constexpr (sizeof(T) == 4) {
+    return _mm512_mask_blend_epi32(m, a, b);
+  } else {
+    return _mm512_mask_blend_epi64(m, a, b);
+  }
+}
+
+// _mm512_permutexvar_epi32 with every lane selected, gcc warns about the
+// undefined source register the unmasked version uses internally
+SIMD_SORT_TARGET inline __m512i avx512_permute(const int32_t *permute,
+                                               __m512i v) {
+  return _mm512_maskz_permutexvar_epi32(
+      0xFFFF, _mm512_loadu_si512(static_cast<const void *>(permute)), v);
+}
+
+template <class T>
+SIMD_SORT_TARGET inline __m512i
+avx512_bitonic_step(__m512i v, const bitonic_step_table<16> &s) {
+  __m512i partner = avx512_permute(s.permute.data(), v);
+  auto take_max = static_cast<avx512_mask<T>>(s.take_max_lanes);
+  auto swap = static_cast<avx512_mask<T>>(
+      (avx512_ops<T>::less(v, partner) & take_max) |
+      (avx512_ops<T>::less(partner, v) & ~take_max));
+  return avx512_blend<T>(swap, v, partner);
+}
+
+template <class T>
+SIMD_SORT_TARGET inline __m512i avx512_sort_register(__m512i v) {
+  for (const auto &s : bitonic_sort_steps<16, 64 / sizeof(T)>) {
+    v = avx512_bitonic_step<T>(v, s);
+  }
+  return v;
+}
+
+template <class T>
+SIMD_SORT_TARGET inline void avx512_merge_registers(__m512i &a, __m512i &b) {
+  constexpr size_t lanes = 64 / sizeof(T);
+  b = avx512_permute(reverse_lanes<16, lanes>.data(), b);
+  avx512_mask<T> swap = avx512_ops<T>::less(b, a);
+  __m512i low = avx512_blend<T>(swap, a, b);
+  __m512i high = avx512_blend<T>(swap, b, a);
+  for (const auto &s : bitonic_clean_steps<16, lanes>) {
+    low = avx512_bitonic_step<T>(low, s);
+    high = avx512_bitonic_step<T>(high, s);
+  }
+  a = low;
+  b = high;
+}
+
+template <class T> SIMD_SORT_TARGET inline __m512i avx512_load(const T *p) {
+  return _mm512_loadu_si512(static_cast<const void *>(p));
+}
+
+template <class T>
+SIMD_SORT_TARGET inline void avx512_store(T *p, __m512i v) {
+  _mm512_storeu_si512(static_cast<void *>(p), v);
+}
+
+// the same as avx2_merge
+template <class T>
+SIMD_SORT_TARGET void avx512_merge(const T *first1, const T *last1,
+                                   const T *first2, const T *last2, T *out) {
+  constexpr size_t lanes = 64 / sizeof(T);
+  if (static_cast<size_t>(last1 - first1) < lanes ||
+      static_cast<size_t>(last2 - first2) < lanes) {
+    std::merge(first1, last1, first2, last2, out);
+    return;
+  }
+  __m512i low = avx512_load(first1);
+  __m512i high = avx512_load(first2);
+  first1 += lanes;
+  first2 += lanes;
+  avx512_merge_registers<T>(low, high);
+  avx512_store(out, low);
+  out += lanes;
+  while (true) {
+    bool from_first =
+        first2 == last2 || (first1 != last1 && !(*first2 < *first1));
+    const T *&next = from_first ? first1 : first2;
+    const T *next_last = from_first ? last1 : last2;
+    if (static_cast<size_t>(next_last - next) < lanes) {
+      break;
+    }
+    low = avx512_load(next);
+    next += lanes;
+    avx512_merge_registers<T>(low, high);
+    avx512_store(out, low);
+    out += lanes;
+  }
+  T kept[lanes];
+  avx512_store(kept, high);
+  T small[2 * lanes];
+  bool first_short = static_cast<size_t>(last1 - first1) < lanes;
+  const T *short_first = first_short ? first1 : first2;
+  const T *short_last = first_short ? last1 : last2;
+  T *small_last =
+      std::merge(kept, kept + lanes, short_first, short_last, small);
+  if (first_short) {
+    std::merge(small, small_last, first2, last2, out);
+  } else {
+    std::merge(small, small_last, first1, last1, out);
+  }
+}
+
+// the same as avx2_sort
+template <class T>
+SIMD_SORT_TARGET void avx512_sort(T *data, size_t n, T *scratch) {
+  constexpr size_t lanes = 64 / sizeof(T);
+  if (n < 4 * lanes) {
+    std::sort(data, data + n);
+    return;
+  }
+  size_t full = n - (n % lanes);
+  for (size_t i = 0; i < full; i += lanes) {
+    avx512_store(data + i, avx512_sort_register<T>(avx512_load(data + i)));
+  }
+  std::sort(data + full, data + n);
+
+  std::unique_ptr<T[]> buffer;
+  if (scratch == nullptr) {
+    buffer.reset(new T[n]);
+    scratch = buffer.get();
+  }
+  T *src = data;
+  T *dest = scratch;
+  for (size_t width = lanes; width < n; width *= 2) {
+    for (size_t start = 0; start < n; start += 2 * width) {
+      size_t mid = std::min(start + width, n);
+      size_t end = std::min(start + 2 * width, n);
+      avx512_merge<T>(src + start, src + mid, src + mid, src + end,
+                      dest + start);
+    }
+    std::swap(src, dest);
+  }
+  if (src != data) {
+    std::memcpy(data, src, n * sizeof(T));
+  }
+}
+
+#undef SIMD_SORT_TARGET
+
+#endif
+
+} // namespace detail
+
+// sorts [first, last) in ascending order, using the vectorized sorting network
+// when the key type supports it and the cpu has avx512f or avx2, picked at
+// runtime, and std::sort otherwise
+// scratch, when given, must have space for last - first elements and is used
+// instead of allocating a buffer
+template <class T>
+void simd_sort(T *first, T *last, [[maybe_unused]] T *scratch = nullptr) {
+#if SIMD_SORT_AVX2 == 1
+  if constexpr (is_simd_sortable<T>::value) {
+    if (detail::has_avx512()) {
+      detail::avx512_sort(first, last - first, scratch);
+      return;
+    }
+    if (detail::has_avx2()) {
+      detail::avx2_sort(first, last - first, scratch);
+      return;
+    }
+  }
+#endif
+  std::sort(first, last);
+}
+
+// merges two ascending runs into d_first, using the vectorized merge kernel
+// when the key type supports it and the cpu has avx512f or avx2 and
+// std::merge otherwise
+template <class T>
+T *simd_merge(const T *first1, const T *last1, const T *first2,
+              const T *last2, T *d_first) {
+#if SIMD_SORT_AVX2 == 1
+  if constexpr (is_simd_sortable<T>::value) {
+    if (detail::has_avx512()) {
+      detail::avx512_merge(first1, last1, first2, last2, d_first);
+      return d_first + (last1 - first1) + (last2 - first2);
+    }
+    if (detail::has_avx2()) {
+      detail::avx2_merge(first1, last1, first2, last2, d_first);
+      return d_first + (last1 - first1) + (last2 - first2);
+    }
+  }
+#endif
+  return std::merge(first1, last1, first2, last2, d_first);
+}
+
+} // namespace ParallelTools
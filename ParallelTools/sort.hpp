@@ -1,8 +1,20 @@
 #pragma once
 
 #include "parallel.h"
+#include "parallel_scan.hpp"
+#include "simd_sort.hpp"
 #include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
 #include <functional>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
 #if PARLAY == 1
 #include "parlay/primitives.h"
@@ -10,9 +22,72 @@
 
 namespace ParallelTools {
 
-template <class InputIt, class OutputIt, class Compare = std::less<>>
+template <class Compare, class E>
+inline constexpr bool is_default_less_v =
+    std::is_same_v<Compare, std::less<>> ||
+    std::is_same_v<Compare, std::less<E>>;
+
+namespace detail {
+
+template <class It>
+inline constexpr bool is_contiguous_iterator_v =
+    std::is_pointer_v<It> ||
+    std::is_same_v<It, typename std::vector<typename std::iterator_traits<
+                           It>::value_type>::iterator> ||
+    std::is_same_v<It, typename std::vector<typename std::iterator_traits<
+                           It>::value_type>::const_iterator>;
+
+// whether the simd kernels can be used for these iterators and comparison
+template <class It, class Compare>
+inline constexpr bool use_simd_sort_v =
+    is_simd_sortable<typename std::iterator_traits<It>::value_type>::value &&
+    is_default_less_v<Compare, typename std::iterator_traits<It>::value_type> &&
+    is_contiguous_iterator_v<It>;
+
+// whether Compare can compare the elements of It, used to tell a comparison
+// apart from a scratch buffer in overloads which take either
+template <class Compare, class It>
+inline constexpr bool is_comparator_v = std::is_invocable_r_v<
+    bool, Compare &, const typename std::iterator_traits<It>::value_type &,
+    const typename std::iterator_traits<It>::value_type &>;
+
+// the serial sort used for the leaves of the parallel sorts
+// scratch, when given, has space for last - first elements which the simd
+// kernels use instead of allocating
+template <class RandomIt, class Compare,
+          class E = typename std::iterator_traits<RandomIt>::value_type>
+void leaf_sort(RandomIt first, RandomIt last, Compare comp,
+               [[maybe_unused]] E *scratch = nullptr) {
+  if constexpr (use_simd_sort_v<RandomIt, Compare>) {
+    if (first != last) {
+      ParallelTools::simd_sort(&*first, &*first + (last - first), scratch);
+    }
+  } else {
+    std::sort(first, last, comp);
+  }
+}
+
+// std::merge, but moving the elements instead of copying them
+template <class InputIt, class OutputIt, class Compare>
+OutputIt serial_move_merge(InputIt first1, InputIt last1, InputIt first2,
+                           InputIt last2, OutputIt d_first, Compare comp) {
+  while (first1 != last1 && first2 != last2) {
+    if (comp(*first2, *first1)) {
+      *d_first = std::move(*first2);
+      ++first2;
+    } else {
+      *d_first = std::move(*first1);
+      ++first1;
+    }
+    ++d_first;
+  }
+  d_first = std::move(first1, last1, d_first);
+  return std::move(first2, last2, d_first);
+}
+
+template <bool move_elements, class InputIt, class OutputIt, class Compare>
 void merge(InputIt first1, InputIt last1, InputIt first2, InputIt last2,
-           OutputIt d_first, Compare comp = std::less<>()) {
+           OutputIt d_first, Compare comp) {
   /*
 algorithm merge(A[i...j], B[k...ℓ], C[p...q]) is
 inputs A, B, C : array
@@ -40,32 +115,733 @@ merge(A[r+1...j], B[s...ℓ], C[t+1...q])
   size_t first_length = last1 - first1;
   size_t second_length = last2 - first2;
 
-  InputIt longer_start = (first_length >= second_length) ? first1 : first2;
-  InputIt longer_last = (first_length >= second_length) ? last1 : last2;
+  if (std::min(first_length, second_length) < 10000) {
+    // the simd merge does not keep equal keys in order so it is only used
+    // when equal keys can not be told apart
+    using E = typename std::iterator_traits<InputIt>::value_type;
+    if constexpr (use_simd_sort_v<InputIt, Compare> &&
+                  is_contiguous_iterator_v<OutputIt> &&
+                  std::is_integral_v<E>) {
+      if (first1 != last1 && first2 != last2) {
+        ParallelTools::simd_merge(&*first1, &*first1 + first_length, &*first2,
+                                  &*first2 + second_length, &*d_first);
+        return;
+      }
+    }
+    if constexpr (move_elements) {
+      serial_move_merge(first1, last1, first2, last2, d_first, comp);
+    } else {
+      std::merge(first1, last1, first2, last2, d_first, comp);
+    }
+    return;
+  }
+  // the element at the split point of the longer range goes directly to the
+  // output, to keep the merge stable elements equal to it from the first range
+  // stay on the left and those from the second range go to the right
+  bool split_first = first_length >= second_length;
+  InputIt split1;
+  InputIt split2;
+  if (split_first) {
+    split1 = first1 + (first_length / 2);
+    split2 = std::lower_bound(first2, last2, *split1, comp);
+  } else {
+    split2 = first2 + (second_length / 2);
+    split1 = std::upper_bound(first1, last1, *split2, comp);
+  }
+  InputIt split = split_first ? split1 : split2;
+  OutputIt out_mid = d_first + (split1 - first1) + (split2 - first2);
+  if constexpr (move_elements) {
+    *out_mid = std::move(*split);
+  } else {
+    *out_mid = *split;
+  }
+  ParallelTools::par_do(
+      [&]() {
+        ParallelTools::detail::merge<move_elements>(first1, split1, first2,
+                                                    split2, d_first, comp);
+      },
+      [&]() {
+        ParallelTools::detail::merge<move_elements>(
+            split1 + (split_first ? 1 : 0), last1,
+            split2 + (split_first ? 0 : 1), last2, out_mid + 1, comp);
+      });
+}
+
+} // namespace detail
+
+template <class InputIt, class OutputIt, class Compare = std::less<>>
+void merge(InputIt first1, InputIt last1, InputIt first2, InputIt last2,
+           OutputIt d_first, Compare comp = std::less<>()) {
+  detail::merge<false>(first1, last1, first2, last2, d_first, comp);
+}
+
+// the same as merge, but the elements are moved into d_first
+template <class InputIt, class OutputIt, class Compare = std::less<>>
+void move_merge(InputIt first1, InputIt last1, InputIt first2, InputIt last2,
+                OutputIt d_first, Compare comp = std::less<>()) {
+  detail::merge<true>(first1, last1, first2, last2, d_first, comp);
+}
+
+
+// finds where the merged output of the sorted ranges would be split so that
+// exactly rank elements come before the split
+// returns how many elements of each range come before the split
+// equal elements are ordered by the index of the range they come from
+//
+// each step takes the middle of every remaining search window and uses their
+// median, weighted by window size, as the pivot.  Counting how many elements
+// of every range come before the pivot in the merged order shrinks every
+// window at once, and at least a quarter of the remaining elements are
+// dropped, so there are O(log n) steps of k binary searches each.
+template <class It, class Compare = std::less<>>
+std::vector<size_t> co_rank(const std::vector<std::pair<It, It>> &ranges,
+                            size_t rank, Compare comp = std::less<>()) {
+  size_t k = ranges.size();
+  std::vector<size_t> lo(k, 0);
+  std::vector<size_t> hi(k);
+  for (size_t i = 0; i < k; i++) {
+    hi[i] = ranges[i].second - ranges[i].first;
+  }
+  std::vector<size_t> before(k);
+  std::vector<size_t> order;
+  order.reserve(k);
+  // the merged order of the middles, only one middle comes from each range
+  auto middle_before = [&](size_t a, size_t b) {
+    const auto &x = ranges[a].first[lo[a] + (hi[a] - lo[a]) / 2];
+    const auto &y = ranges[b].first[lo[b] + (hi[b] - lo[b]) / 2];
+    if (comp(x, y)) {
+      return true;
+    }
+    if (comp(y, x)) {
+      return false;
+    }
+    return a < b;
+  };
+  while (true) {
+    order.clear();
+    size_t remaining = 0;
+    for (size_t i = 0; i < k; i++) {
+      if (hi[i] > lo[i]) {
+        order.push_back(i);
+        remaining += hi[i] - lo[i];
+      }
+    }
+    if (remaining == 0) {
+      return lo;
+    }
+    std::sort(order.begin(), order.end(), middle_before);
+    size_t pivot_range = order.back();
+    size_t seen = 0;
+    for (size_t i : order) {
+      seen += hi[i] - lo[i];
+      if (2 * seen >= remaining) {
+        pivot_range = i;
+        break;
+      }
+    }
+    size_t mid = lo[pivot_range] + (hi[pivot_range] - lo[pivot_range]) / 2;
+    const auto &pivot = ranges[pivot_range].first[mid];
+    // the counts are only searched for inside the windows, clamping them like
+    // this does not change which side of the split the pivot is on
+    size_t total = 0;
+    for (size_t i = 0; i < k; i++) {
+      It window_start = ranges[i].first + lo[i];
+      It window_end = ranges[i].first + hi[i];
+      if (i < pivot_range) {
+        before[i] = std::upper_bound(window_start, window_end, pivot, comp) -
+                    ranges[i].first;
+      } else if (i == pivot_range) {
+        before[i] = mid;
+      } else {
+        before[i] = std::lower_bound(window_start, window_end, pivot, comp) -
+                    ranges[i].first;
+      }
+      total += before[i];
+    }
+    if (total < rank) {
+      for (size_t i = 0; i < k; i++) {
+        lo[i] = before[i];
+      }
+      lo[pivot_range] = mid + 1;
+    } else {
+      for (size_t i = 0; i < k; i++) {
+        hi[i] = before[i];
+      }
+    }
+  }
+}
+
+namespace detail {
+
+// a serial stable k way merge using a binary heap of the range heads
+template <class It, class OutputIt, class Compare>
+void multiway_merge(std::vector<std::pair<It, It>> ranges, OutputIt d_first,
+                    Compare comp) {
+  ranges.erase(
+      std::remove_if(ranges.begin(), ranges.end(),
+                     [](const auto &r) { return r.first == r.second; }),
+      ranges.end());
+  if (ranges.empty()) {
+    return;
+  }
+  if (ranges.size() == 1) {
+    std::copy(ranges[0].first, ranges[0].second, d_first);
+    return;
+  }
+  if (ranges.size() == 2) {
+    std::merge(ranges[0].first, ranges[0].second, ranges[1].first,
+               ranges[1].second, d_first, comp);
+    return;
+  }
+  // heap[0] is the range with the smallest head, ties go to the earlier range
+  std::vector<size_t> heap(ranges.size());
+  for (size_t i = 0; i < heap.size(); i++) {
+    heap[i] = i;
+  }
+  auto after = [&](size_t a, size_t b) {
+    if (comp(*ranges[b].first, *ranges[a].first)) {
+      return true;
+    }
+    if (comp(*ranges[a].first, *ranges[b].first)) {
+      return false;
+    }
+    return a > b;
+  };
+  std::make_heap(heap.begin(), heap.end(), after);
+  std::pop_heap(heap.begin(), heap.end(), after);
+  while (true) {
+    size_t i = heap.back();
+    *d_first = *ranges[i].first;
+    ++d_first;
+    ++ranges[i].first;
+    if (ranges[i].first == ranges[i].second) {
+      heap.pop_back();
+      if (heap.size() == 1) {
+        std::copy(ranges[heap[0]].first, ranges[heap[0]].second, d_first);
+        return;
+      }
+    } else {
+      std::push_heap(heap.begin(), heap.end(), after);
+    }
+    std::pop_heap(heap.begin(), heap.end(), after);
+  }
+}
+
+} // namespace detail
+
+// merges any number of sorted ranges into d_first
+// the output is split into pieces with co_rank and each piece is merged
+// independently, so the merge is a single parallel pass over the data
+// the merge is stable, equal elements are ordered by the index of their range
+template <class It, class OutputIt, class Compare = std::less<>>
+void multiway_merge(const std::vector<std::pair<It, It>> &ranges,
+                    OutputIt d_first, Compare comp = std::less<>()) {
+  size_t total = 0;
+  for (const auto &r : ranges) {
+    total += r.second - r.first;
+  }
+  size_t num_pieces =
+      std::min(total / 10000, static_cast<size_t>(getWorkers()) * 4);
+  if (PARALLEL == 0 || num_pieces <= 1) {
+    detail::multiway_merge(ranges, d_first, comp);
+    return;
+  }
+  std::vector<std::vector<size_t>> splits(num_pieces + 1);
+  ParallelTools::parallel_for(
+      0, num_pieces + 1,
+      [&](size_t i) {
+        splits[i] = co_rank(ranges, total * i / num_pieces, comp);
+      },
+      1);
+  ParallelTools::parallel_for(
+      0, num_pieces,
+      [&](size_t i) {
+        std::vector<std::pair<It, It>> pieces(ranges.size());
+        for (size_t j = 0; j < ranges.size(); j++) {
+          pieces[j] = {ranges[j].first + splits[i][j],
+                       ranges[j].first + splits[i + 1][j]};
+        }
+        detail::multiway_merge(pieces, d_first + total * i / num_pieces, comp);
+      },
+      1);
+}
+
+// scratch space for the sorts
+// elements are only constructed if they need to be so that the buffer is just
+// a malloc for trivial types
+template <class E> class sort_buffer {
+  E *data_;
+  size_t size_;
+
+public:
+  explicit sort_buffer(size_t size)
+      : data_(static_cast<E *>(std::malloc(size * sizeof(E)))), size_(size) {
+    if constexpr (!std::is_trivially_default_constructible_v<E>) {
+      ParallelTools::parallel_for(0, size_,
+                                  [&](size_t i) { new (data_ + i) E(); });
+    }
+  }
+  ~sort_buffer() {
+    if constexpr (!std::is_trivially_destructible_v<E>) {
+      ParallelTools::parallel_for(0, size_, [&](size_t i) { data_[i].~E(); });
+    }
+    std::free(data_);
+  }
+  sort_buffer(const sort_buffer &) = delete;
+  sort_buffer &operator=(const sort_buffer &) = delete;
+
+  E *data() { return data_; }
+  [[nodiscard]] size_t size() const { return size_; }
+  E &operator[](size_t i) { return data_[i]; }
+};
+
+namespace detail {
+
+static constexpr size_t sample_sort_serial_cutoff = 1UL << 15U;
+static constexpr size_t sample_sort_max_pivots = 1023;
+static constexpr size_t sample_sort_oversample = 8;
+static constexpr size_t sample_sort_min_block_size = 1UL << 14U;
+
+// counts holds num_blocks rows of num_buckets counts, it is replaced with the
+// offset each block should write each bucket to so that the buckets are
+// contiguous and in order.
+// bucket_starts[i] is filled with where bucket i starts, it needs space for
+// num_buckets + 1 entries
+inline void bucket_offsets(size_t *counts, size_t num_blocks,
+                           size_t num_buckets, size_t *bucket_starts) {
+  // the scan goes in bucket major order
+  size_t total = ParallelTools::parallel_scan(
+      index_range(0, num_blocks * num_buckets), size_t{0},
+      [&](const index_range &r, size_t value, bool is_final) {
+        for (size_t k = r.begin(); k < r.end(); k++) {
+          size_t b = k / num_blocks;
+          size_t block = k % num_blocks;
+          size_t count = counts[block * num_buckets + b];
+          if (is_final) {
+            counts[block * num_buckets + b] = value;
+            if (block == 0) {
+              bucket_starts[b] = value;
+            }
+          }
+          value += count;
+        }
+        return value;
+      },
+      std::plus<>());
+  bucket_starts[num_buckets] = total;
+}
+
+inline uint64_t sort_hash(uint64_t x) {
+  x ^= x >> 33U;
+  x *= 0xff51afd7ed558ccdUL;
+  x ^= x >> 33U;
+  x *= 0xc4ceb9fe1a85ec53UL;
+  x ^= x >> 33U;
+  return x;
+}
 
-  InputIt shorter_start = (first_length < second_length) ? first1 : first2;
-  InputIt shorter_last = (first_length < second_length) ? last1 : last2;
-  if (shorter_last - shorter_start < 10000) {
-    std::merge(first1, last1, first2, last2, d_first, comp);
+// sorts [first, first + n) using scratch[0, n) and bucket_ids[0, n) as the
+// only extra space, both are allocated once by the caller and each recursive
+// call reuses the pieces under its bucket
+//
+// elements are distributed into buckets defined by sampled pivots, each
+// distinct pivot also gets its own bucket of the elements equal to it, which
+// never needs sorting, so heavy duplicates finish in a single pass.  Buckets
+// are then moved back and sorted independently, recursing with the matching
+// piece of scratch if they are still large.
+template <class RandomIt, class Compare>
+void sample_sort(RandomIt first, size_t n,
+                 typename std::iterator_traits<RandomIt>::value_type *scratch,
+                 uint16_t *bucket_ids, Compare comp) {
+  using E = typename std::iterator_traits<RandomIt>::value_type;
+  if (n < sample_sort_serial_cutoff) {
+    leaf_sort(first, first + n, comp, scratch);
     return;
   }
-  InputIt r = longer_start + ((longer_last - longer_start) / 2);
-  InputIt s = std::lower_bound(shorter_start, shorter_last, *r, comp);
-  OutputIt out_mid = d_first + (r - longer_start) + (s - shorter_start);
-  *out_mid = *r;
+
+  // pick the pivots from an oversampled, sorted sample
+  size_t num_pivots = 1;
+  while ((num_pivots + 1) * (num_pivots + 1) < n &&
+         num_pivots < sample_sort_max_pivots) {
+    num_pivots = num_pivots * 2 + 1;
+  }
+  size_t sample_size = (num_pivots + 1) * sample_sort_oversample;
+  std::vector<E> pivots;
+  pivots.reserve(sample_size);
+  for (size_t i = 0; i < sample_size; i++) {
+    pivots.push_back(first[sort_hash(i + n) % n]);
+  }
+  std::sort(pivots.begin(), pivots.end(), comp);
+  for (size_t i = 0; i < num_pivots; i++) {
+    pivots[i] = pivots[(i + 1) * sample_sort_oversample - 1];
+  }
+  pivots.resize(num_pivots);
+  pivots.erase(std::unique(pivots.begin(), pivots.end(),
+                           [&](const E &a, const E &b) {
+                             return !comp(a, b) && !comp(b, a);
+                           }),
+               pivots.end());
+  num_pivots = pivots.size();
+  size_t num_buckets = 2 * num_pivots + 1;
+
+  auto bucket_of = [&](const E &e) -> uint16_t {
+    size_t j = std::lower_bound(pivots.begin(), pivots.end(), e, comp) -
+               pivots.begin();
+    if (j < num_pivots && !comp(e, pivots[j])) {
+      return static_cast<uint16_t>(2 * j + 1);
+    }
+    return static_cast<uint16_t>(2 * j);
+  };
+
+  size_t num_blocks =
+      std::min(std::max(n / sample_sort_min_block_size, size_t{1}),
+               static_cast<size_t>(ParallelTools::getWorkers()) * 4);
+  size_t block_size = (n + num_blocks - 1) / num_blocks;
+  num_blocks = (n + block_size - 1) / block_size;
+
+  // count how many elements from each block go to each bucket
+  std::vector<size_t> counts(num_blocks * num_buckets);
+  ParallelTools::parallel_for(
+      0, num_blocks,
+      [&](size_t block) {
+        size_t *block_counts = counts.data() + block * num_buckets;
+        size_t end = std::min((block + 1) * block_size, n);
+        for (size_t i = block * block_size; i < end; i++) {
+          uint16_t b = bucket_of(first[i]);
+          bucket_ids[i] = b;
+          block_counts[b]++;
+        }
+      },
+      1);
+
+  std::vector<size_t> bucket_starts(num_buckets + 1);
+  bucket_offsets(counts.data(), num_blocks, num_buckets, bucket_starts.data());
+
+  ParallelTools::parallel_for(
+      0, num_blocks,
+      [&](size_t block) {
+        size_t *offsets = counts.data() + block * num_buckets;
+        size_t end = std::min((block + 1) * block_size, n);
+        for (size_t i = block * block_size; i < end; i++) {
+          scratch[offsets[bucket_ids[i]]++] = std::move(first[i]);
+        }
+      },
+      1);
+
+  ParallelTools::parallel_for(
+      0, num_buckets,
+      [&](size_t b) {
+        size_t start = bucket_starts[b];
+        size_t end = bucket_starts[b + 1];
+        std::move(scratch + start, scratch + end, first + start);
+        // odd buckets only hold copies of a single pivot
+        if (b % 2 == 1) {
+          return;
+        }
+        ParallelTools::detail::sample_sort(first + start, end - start,
+                                           scratch + start,
+                                           bucket_ids + start, comp);
+      },
+      1);
+}
+
+static constexpr size_t radix_sort_serial_cutoff = 1UL << 12U;
+static constexpr size_t radix_sort_min_block_size = 1UL << 14U;
+static constexpr unsigned radix_bits = 8;
+static constexpr size_t radix_buckets = 1UL << radix_bits;
+
+// the key as an unsigned integer whose order matches the order of the key
+template <class K> auto radix_key(K k) {
+  using U = std::make_unsigned_t<K>;
+  if constexpr (std::is_signed_v<K>) {
+    return static_cast<U>(static_cast<U>(k) ^
+                          (U(1) << (sizeof(U) * 8 - 1)));
+  } else {
+    return static_cast<U>(k);
+  }
+}
+
+// one stable counting sort pass on the digit at shift from src into dest
+// returns false without moving anything if every key has the same digit
+template <class Src, class Dest, class Key>
+bool radix_pass(Src src, Dest dest, size_t n, Key &key, unsigned shift,
+                size_t num_blocks, size_t block_size, size_t *counts) {
+  auto digit = [&](size_t i) -> size_t {
+    return (radix_key(key(src[i])) >> shift) & (radix_buckets - 1);
+  };
+  std::fill(counts, counts + num_blocks * radix_buckets, 0);
+  ParallelTools::parallel_for(
+      0, num_blocks,
+      [&](size_t block) {
+        size_t *block_counts = counts + block * radix_buckets;
+        size_t end = std::min((block + 1) * block_size, n);
+        for (size_t i = block * block_size; i < end; i++) {
+          block_counts[digit(i)]++;
+        }
+      },
+      1);
+  for (size_t b = 0; b < radix_buckets; b++) {
+    size_t total = 0;
+    for (size_t block = 0; block < num_blocks; block++) {
+      total += counts[block * radix_buckets + b];
+    }
+    if (total == n) {
+      return false;
+    }
+    if (total != 0) {
+      break;
+    }
+  }
+  size_t bucket_starts[radix_buckets + 1];
+  bucket_offsets(counts, num_blocks, radix_buckets, bucket_starts);
+  ParallelTools::parallel_for(
+      0, num_blocks,
+      [&](size_t block) {
+        size_t *offsets = counts + block * radix_buckets;
+        size_t end = std::min((block + 1) * block_size, n);
+        for (size_t i = block * block_size; i < end; i++) {
+          dest[offsets[digit(i)]++] = std::move(src[i]);
+        }
+      },
+      1);
+  return true;
+}
+
+static constexpr size_t merge_sort_serial_cutoff = 10000;
+
+// sorts [in, in + n) using scratch[0, n) as the other buffer
+// when to_scratch is set the sorted output ends up in scratch, otherwise in in
+// each level merges out of the buffer the level below left its output in, so
+// nothing is ever copied back
+// the merges are stable so the sort is stable when stable is set
+template <bool stable, class RandomIt, class ScratchIt, class Compare>
+void merge_sort(RandomIt in, ScratchIt scratch, size_t n, bool to_scratch,
+                Compare comp) {
+  if (n < merge_sort_serial_cutoff) {
+    if constexpr (stable) {
+      std::stable_sort(in, in + n, comp);
+    } else if constexpr (std::is_same_v<ScratchIt,
+                                        typename std::iterator_traits<
+                                            RandomIt>::value_type *>) {
+      leaf_sort(in, in + n, comp, scratch);
+    } else {
+      leaf_sort(in, in + n, comp);
+    }
+    if (to_scratch) {
+      std::move(in, in + n, scratch);
+    }
+    return;
+  }
+  size_t half = n / 2;
   ParallelTools::par_do(
       [&]() {
-        ParallelTools::merge(longer_start, r, shorter_start, s, d_first, comp);
+        ParallelTools::detail::merge_sort<stable>(in, scratch, half,
+                                                  !to_scratch, comp);
       },
       [&]() {
-        ParallelTools::merge(r + 1, longer_last, s, shorter_last, out_mid + 1,
-                             comp);
+        ParallelTools::detail::merge_sort<stable>(
+            in + half, scratch + half, n - half, !to_scratch, comp);
       });
+  if (to_scratch) {
+    ParallelTools::move_merge(in, in + half, in + half, in + n, scratch, comp);
+  } else {
+    ParallelTools::move_merge(scratch, scratch + half, scratch + half,
+                              scratch + n, in, comp);
+  }
+}
+
+} // namespace detail
+
+// a parallel merge sort which ping-pongs between the input and a single
+// scratch buffer the size of the input
+// scratch must have space for at least last - first elements, what it holds
+// afterwards is unspecified, so the same buffer can be reused for repeated
+// sorts without allocating
+template <class RandomIt, class ScratchIt, class Compare = std::less<>,
+          std::enable_if_t<!detail::is_comparator_v<ScratchIt, RandomIt>,
+                           int> = 0>
+void merge_sort(RandomIt first, RandomIt last, ScratchIt scratch,
+                Compare comp = std::less<>()) {
+  detail::merge_sort<false>(first, scratch, last - first, false, comp);
+}
+
+template <class RandomIt, class Compare = std::less<>,
+          std::enable_if_t<detail::is_comparator_v<Compare, RandomIt>, int> =
+              0>
+void merge_sort(RandomIt first, RandomIt last, Compare comp = std::less<>()) {
+  using E = typename std::iterator_traits<RandomIt>::value_type;
+  size_t n = last - first;
+  if (n < detail::merge_sort_serial_cutoff) {
+    detail::leaf_sort(first, last, comp);
+    return;
+  }
+  sort_buffer<E> scratch(n);
+  merge_sort(first, last, scratch.data(), comp);
+}
+
+// any type which is radix sortable will be sorted with radix_sort by sort
+// when the default comparison is used
+// this can be specialized for other types whose order under < matches the
+// order of an integer key, together with radix_key_of to extract that key
+template <class T>
+struct is_radix_sortable
+    : std::bool_constant<std::is_integral_v<T> && !std::is_same_v<T, bool>> {
+};
+
+// the key integer_sort, and through it sort and stable_sort, radix sorts
+// elements of type T by.  radix_sort accepts any key whose type is a signed
+// or unsigned integer and orders the elements by its value.  By default the
+// element is its own key, types which specialize is_radix_sortable specialize
+// this too so it returns an integer whose order matches their order under <
+template <class T> struct radix_key_of {
+  T operator()(const T &e) const { return e; }
+};
+
+// a stable parallel LSD radix sort
+// key(e) must return an integer, elements are ordered by the value of their
+// key.
+// each pass counts the digits for each block in parallel, scans the counts to
+// find where each block writes each digit to, and then scatters.  Passes where
+// every key has the same digit are skipped.
+template <class RandomIt, class Key>
+void radix_sort(RandomIt first, RandomIt last, Key key) {
+  using E = typename std::iterator_traits<RandomIt>::value_type;
+  using K = std::decay_t<decltype(key(*first))>;
+  static_assert(std::is_integral_v<K>, "radix_sort requires integer keys");
+  size_t n = last - first;
+  if (n < detail::radix_sort_serial_cutoff) {
+    std::stable_sort(first, last, [&](const E &a, const E &b) {
+      return detail::radix_key(key(a)) < detail::radix_key(key(b));
+    });
+    return;
+  }
+  size_t num_blocks =
+      std::min(std::max(n / detail::radix_sort_min_block_size, size_t{1}),
+               static_cast<size_t>(ParallelTools::getWorkers()) * 4);
+  size_t block_size = (n + num_blocks - 1) / num_blocks;
+  num_blocks = (n + block_size - 1) / block_size;
+  std::vector<size_t> counts(num_blocks * detail::radix_buckets);
+
+  sort_buffer<E> scratch(n);
+  bool in_scratch = false;
+  for (unsigned shift = 0; shift < sizeof(K) * 8;
+       shift += detail::radix_bits) {
+    if (in_scratch) {
+      in_scratch = !detail::radix_pass(scratch.data(), first, n, key, shift,
+                                       num_blocks, block_size, counts.data());
+    } else {
+      in_scratch = detail::radix_pass(first, scratch.data(), n, key, shift,
+                                      num_blocks, block_size, counts.data());
+    }
+  }
+  if (in_scratch) {
+    ParallelTools::parallel_for(
+        0, n, [&](size_t i) { first[i] = std::move(scratch[i]); });
+  }
+}
+
+// radix sort elements which are themselves integers, or which have a
+// radix_key_of specialization
+template <class RandomIt> void integer_sort(RandomIt first, RandomIt last) {
+  using E = typename std::iterator_traits<RandomIt>::value_type;
+  radix_sort(first, last, radix_key_of<E>());
 }
 
-// TODO(wheatman) make a better parallel sort
+// a parallel sort which keeps equal elements in their original order
+template <class RandomIt, class Compare = std::less<>>
+void stable_sort(RandomIt first, RandomIt last, Compare comp = std::less<>()) {
+  using E = typename std::iterator_traits<RandomIt>::value_type;
+  if constexpr (is_radix_sortable<E>::value && is_default_less_v<Compare, E>) {
+    integer_sort(first, last);
+    return;
+  }
+#if PARALLEL == 0
+  std::stable_sort(first, last, comp);
+  return;
+#endif
+#if PARLAY == 1
+  if constexpr (parlay::is_random_access_iterator_v<RandomIt>) {
+    parlay::stable_sort_inplace(parlay::make_slice(first, last), comp);
+    return;
+  }
+#endif
+  size_t n = last - first;
+  if (n < detail::merge_sort_serial_cutoff) {
+    std::stable_sort(first, last, comp);
+    return;
+  }
+  sort_buffer<E> scratch(n);
+  detail::merge_sort<true>(first, scratch.data(), n, false, comp);
+}
+
+namespace detail {
+
+template <class Index, class KeyIt, class Compare, class... ValueIts>
+void sort_by_key(KeyIt first, size_t n, Compare comp, ValueIts... values) {
+  using K = typename std::iterator_traits<KeyIt>::value_type;
+  using Entry = std::pair<K, Index>;
+  sort_buffer<Entry> entries(n);
+  ParallelTools::parallel_for(0, n, [&](size_t i) {
+    entries[i] = {std::move(first[i]), static_cast<Index>(i)};
+  });
+  if constexpr (is_radix_sortable<K>::value && is_default_less_v<Compare, K>) {
+    radix_sort(entries.data(), entries.data() + n,
+               [](const Entry &e) { return e.first; });
+  } else {
+    ParallelTools::stable_sort(
+        entries.data(), entries.data() + n,
+        [&](const Entry &a, const Entry &b) { return comp(a.first, b.first); });
+  }
+  ParallelTools::parallel_for(
+      0, n, [&](size_t i) { first[i] = std::move(entries[i].first); });
+
+  // each payload is gathered through the permutation in a single pass
+  auto permute = [&](auto values_first) {
+    using V = typename std::iterator_traits<decltype(values_first)>::value_type;
+    sort_buffer<V> gathered(n);
+    ParallelTools::parallel_for(0, n, [&](size_t i) {
+      gathered[i] = std::move(values_first[entries[i].second]);
+    });
+    ParallelTools::parallel_for(
+        0, n, [&](size_t i) { values_first[i] = std::move(gathered[i]); });
+  };
+  (permute(values), ...);
+}
+
+} // namespace detail
+
+// sorts the keys in [first, last) and applies the same permutation to each of
+// the ranges starting at values, which must each have at least last - first
+// elements.
+// The sort is stable, only the keys and their original positions are moved
+// while sorting, each of the values is moved once at the end.
+template <class KeyIt, class Compare, class... ValueIts>
+void sort_by_key_comp(KeyIt first, KeyIt last, Compare comp,
+                      ValueIts... values) {
+  size_t n = last - first;
+  if (n <= std::numeric_limits<uint32_t>::max()) {
+    detail::sort_by_key<uint32_t>(first, n, comp, values...);
+  } else {
+    detail::sort_by_key<uint64_t>(first, n, comp, values...);
+  }
+}
+
+template <class KeyIt, class... ValueIts>
+void sort_by_key(KeyIt first, KeyIt last, ValueIts... values) {
+  sort_by_key_comp(first, last, std::less<>(), values...);
+}
+
+// a parallel samplesort, it will use a single scratch buffer the same size as
+// the input
+// types which are radix sortable are sorted with integer_sort when the
+// default comparison is used
 template <class RandomIt, class Compare = std::less<>>
 void sort(RandomIt first, RandomIt last, Compare comp = std::less<>()) {
+  using E = typename std::iterator_traits<RandomIt>::value_type;
+  if constexpr (is_radix_sortable<E>::value && is_default_less_v<Compare, E>) {
+    integer_sort(first, last);
+    return;
+  }
 #if PARALLEL == 0
   std::sort(first, last, comp);
   return;
@@ -76,23 +852,239 @@ void sort(RandomIt first, RandomIt last, Compare comp = std::less<>()) {
     return;
   }
 #endif
+  size_t n = last - first;
+  if (n < detail::sample_sort_serial_cutoff) {
+    detail::leaf_sort(first, last, comp);
+    return;
+  }
+  sort_buffer<E> scratch(n);
+  sort_buffer<uint16_t> bucket_ids(n);
+  detail::sample_sort(first, n, scratch.data(), bucket_ids.data(), comp);
+}
+
+namespace detail {
+
+static constexpr size_t select_serial_cutoff = 1UL << 15U;
+static constexpr size_t select_sample_size = 4096;
+static constexpr size_t select_sample_slack = 128;
+
+// how many sample positions past position a threshold must go to be above the
+// element it estimates with high probability, rank k lands within about
+// sqrt(position) positions of position in the sample, so this is a few of
+// those plus a constant for when position is small
+inline size_t sample_slack(size_t position) {
+  return 4 * static_cast<size_t>(std::sqrt(static_cast<double>(position))) +
+         4;
+}
+
+// moves [first, first + n) so each bucket is contiguous and in order, going
+// through scratch, stable within each bucket
+// bucket_of(e) must return a bucket less than num_buckets
+// bucket_starts needs space for num_buckets + 1 entries
+template <class RandomIt, class BucketOf>
+void distribute(RandomIt first, size_t n,
+                typename std::iterator_traits<RandomIt>::value_type *scratch,
+                size_t num_buckets, const BucketOf &bucket_of,
+                size_t *bucket_starts) {
+  size_t num_blocks =
+      std::min(std::max(n / sample_sort_min_block_size, size_t{1}),
+               static_cast<size_t>(ParallelTools::getWorkers()) * 4);
+  size_t block_size = (n + num_blocks - 1) / num_blocks;
+  num_blocks = (n + block_size - 1) / block_size;
+  std::vector<size_t> counts(num_blocks * num_buckets);
+  ParallelTools::parallel_for(
+      0, num_blocks,
+      [&](size_t block) {
+        size_t *block_counts = counts.data() + block * num_buckets;
+        size_t end = std::min((block + 1) * block_size, n);
+        for (size_t i = block * block_size; i < end; i++) {
+          block_counts[bucket_of(first[i])]++;
+        }
+      },
+      1);
+  bucket_offsets(counts.data(), num_blocks, num_buckets, bucket_starts);
+  ParallelTools::parallel_for(
+      0, num_blocks,
+      [&](size_t block) {
+        size_t *offsets = counts.data() + block * num_buckets;
+        size_t end = std::min((block + 1) * block_size, n);
+        for (size_t i = block * block_size; i < end; i++) {
+          scratch[offsets[bucket_of(first[i])]++] = std::move(first[i]);
+        }
+      },
+      1);
+  ParallelTools::parallel_for(
+      0, n, [&](size_t i) { first[i] = std::move(scratch[i]); });
+}
+
+// a sorted sample of [first, first + n)
+template <class RandomIt>
+std::vector<typename std::iterator_traits<RandomIt>::value_type>
+sample(RandomIt first, size_t n, size_t sample_size, uint64_t seed) {
+  std::vector<typename std::iterator_traits<RandomIt>::value_type> samples;
+  samples.reserve(sample_size);
+  for (size_t i = 0; i < sample_size; i++) {
+    samples.push_back(first[sort_hash(i + seed) % n]);
+  }
+  return samples;
+}
+
+// places the element of rank k at first + k with everything before it not
+// greater and everything after it not less
+//
+// each round picks two pivots from a sample which bracket rank k with high
+// probability and splits the range into less than, equal to, and between the
+// pivots.  Only the piece holding rank k is continued with, which is usually
+// the small range between the pivots, and the pieces equal to a pivot never
+// need more work.
+template <class RandomIt, class Compare>
+void nth_element(RandomIt first, size_t n, size_t k,
+                 typename std::iterator_traits<RandomIt>::value_type *scratch,
+                 Compare comp) {
   using E = typename std::iterator_traits<RandomIt>::value_type;
-  if (last - first < 10000) {
-    std::sort(first, last, comp);
-  } else {
-    RandomIt mid = first + ((last - first) / 2);
-    E *tmp = nullptr;
-    ParallelTools::par_do([&]() { ParallelTools::sort(first, mid, comp); },
-                          [&]() {
-                            ParallelTools::sort(mid, last, comp);
-                            tmp = (E *)malloc((last - first) * sizeof(E));
-                          });
-
-    merge(first, mid, mid, last, tmp, comp);
-    ParallelTools::parallel_for(0, last - first,
-                                [&](size_t i) { first[i] = tmp[i]; });
-    free(tmp);
+  while (n >= select_serial_cutoff) {
+    std::vector<E> samples = sample(first, n, select_sample_size, n + k);
+    std::sort(samples.begin(), samples.end(), comp);
+    size_t position = k * select_sample_size / n;
+    const E low = samples[position > select_sample_slack
+                              ? position - select_sample_slack
+                              : 0];
+    const E high = samples[std::min(position + select_sample_slack,
+                                    select_sample_size - 1)];
+    auto bucket_of = [&](const E &e) -> size_t {
+      if (comp(e, low)) {
+        return 0;
+      }
+      if (!comp(low, e)) {
+        return 1;
+      }
+      if (comp(e, high)) {
+        return 2;
+      }
+      if (!comp(high, e)) {
+        return 3;
+      }
+      return 4;
+    };
+    size_t bucket_starts[6];
+    distribute(first, n, scratch, 5, bucket_of, bucket_starts);
+    size_t bucket = 0;
+    while (bucket_starts[bucket + 1] <= k) {
+      bucket++;
+    }
+    if (bucket == 1 || bucket == 3) {
+      return;
+    }
+    first += bucket_starts[bucket];
+    scratch += bucket_starts[bucket];
+    k -= bucket_starts[bucket];
+    n = bucket_starts[bucket + 1] - bucket_starts[bucket];
+  }
+  std::nth_element(first, first + k, first + n, comp);
+}
+
+} // namespace detail
+
+// a parallel std::nth_element
+template <class RandomIt, class Compare = std::less<>>
+void nth_element(RandomIt first, RandomIt nth, RandomIt last,
+                 Compare comp = std::less<>()) {
+  using E = typename std::iterator_traits<RandomIt>::value_type;
+  size_t n = last - first;
+  if (PARALLEL == 0 || n < detail::select_serial_cutoff || nth == last) {
+    std::nth_element(first, nth, last, comp);
+    return;
+  }
+  sort_buffer<E> scratch(n);
+  detail::nth_element(first, n, nth - first, scratch.data(), comp);
+}
+
+// a parallel std::partial_sort
+template <class RandomIt, class Compare = std::less<>>
+void partial_sort(RandomIt first, RandomIt middle, RandomIt last,
+                  Compare comp = std::less<>()) {
+  if (middle == first) {
+    return;
+  }
+  ParallelTools::nth_element(first, middle - 1, last, comp);
+  ParallelTools::sort(first, middle - 1, comp);
+}
+
+// returns the k smallest elements in sorted order without modifying the input
+//
+// when k is small compared to the input a threshold just above rank k is
+// picked from a sample and only the elements up to it are copied out, so the
+// work is a single parallel pass over the input plus sorting the candidates.
+// The sample has about sqrt(n) elements and the threshold sits a few standard
+// deviations past rank k, so there are O(k + sqrt(n)) candidates in
+// expectation.
+template <class RandomIt, class Compare = std::less<>>
+std::vector<typename std::iterator_traits<RandomIt>::value_type>
+top_k(RandomIt first, RandomIt last, size_t k, Compare comp = std::less<>()) {
+  using E = typename std::iterator_traits<RandomIt>::value_type;
+  size_t n = last - first;
+  k = std::min(k, n);
+  std::vector<E> output;
+  if (k == 0) {
+    return output;
+  }
+  size_t sample_size =
+      std::max(detail::select_sample_size,
+               static_cast<size_t>(std::sqrt(static_cast<double>(n))));
+  size_t position = k * sample_size / n;
+  size_t threshold_position = position + detail::sample_slack(position);
+  if (n >= detail::select_serial_cutoff && threshold_position < sample_size) {
+    std::vector<E> samples = detail::sample(first, n, sample_size, n + k);
+    std::sort(samples.begin(), samples.end(), comp);
+    const E threshold = samples[threshold_position];
+    // copy out everything not greater than the threshold
+    size_t num_blocks =
+        std::min(std::max(n / detail::sample_sort_min_block_size, size_t{1}),
+                 static_cast<size_t>(ParallelTools::getWorkers()) * 4);
+    size_t block_size = (n + num_blocks - 1) / num_blocks;
+    num_blocks = (n + block_size - 1) / block_size;
+    std::vector<size_t> counts(num_blocks);
+    ParallelTools::parallel_for(
+        0, num_blocks,
+        [&](size_t block) {
+          size_t end = std::min((block + 1) * block_size, n);
+          for (size_t i = block * block_size; i < end; i++) {
+            counts[block] += !comp(threshold, first[i]);
+          }
+        },
+        1);
+    size_t total = 0;
+    for (auto &count : counts) {
+      size_t next = total + count;
+      count = total;
+      total = next;
+    }
+    if (total >= k) {
+      output.resize(total);
+      ParallelTools::parallel_for(
+          0, num_blocks,
+          [&](size_t block) {
+            size_t end = std::min((block + 1) * block_size, n);
+            size_t j = counts[block];
+            for (size_t i = block * block_size; i < end; i++) {
+              if (!comp(threshold, first[i])) {
+                output[j++] = first[i];
+              }
+            }
+          },
+          1);
+      ParallelTools::partial_sort(output.begin(), output.begin() + k,
+                                  output.end(), comp);
+      output.resize(k);
+      return output;
+    }
+    // the sample was unlucky, fall through to the general case
   }
+  output.assign(first, last);
+  ParallelTools::partial_sort(output.begin(), output.begin() + k, output.end(),
+                              comp);
+  output.resize(k);
+  return output;
 }
 
 } // namespace ParallelTools
@@ -0,0 +1,441 @@
+#pragma once
+
+// a work stealing scheduler built only on std::thread, this is what
+// parallel.h runs on when PT_THREADS == 1
+//
+// each worker owns a Chase-Lev deque, it pushes and pops work at the bottom
+// and idle workers steal from the top of a random victim.  Workers which fail
+// to find anything for a while go to sleep and are woken when new work is
+// pushed.
+//
+// the thread which first uses the scheduler becomes worker 0 and the others
+// are started then, the number of workers is taken from PT_NUM_THREADS if it
+// is set and std::thread::hardware_concurrency otherwise.  Any other thread
+// which is not one of the workers runs everything serially and reports itself
+// as worker 0, so it shares the per worker slots of things like Reducer with
+// worker 0 and must not use them while the workers might.
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace ParallelTools {
+
+namespace detail {
+
+class job {
+  std::atomic<bool> done_{false};
+  // the worker which stole the job, -1 until that is known
+  std::atomic<int> thief_{-1};
+
+protected:
+  virtual void run() = 0;
+  // the job may be destroyed as soon as it is finished so nothing can touch it
+  // after that
+  virtual void finish() { done_.store(true, std::memory_order_release); }
+
+public:
+  virtual ~job() = default;
+  void execute() {
+    run();
+    finish();
+  }
+  // the task_group the job belongs to, if any
+  [[nodiscard]] virtual const void *group() const { return nullptr; }
+  [[nodiscard]] bool done() const {
+    return done_.load(std::memory_order_acquire);
+  }
+  void set_thief(int id) { thief_.store(id, std::memory_order_release); }
+  [[nodiscard]] int thief() const {
+    return thief_.load(std::memory_order_acquire);
+  }
+};
+
+// a job spawned by a task_group, it owns its function and deletes itself
+// once it has run, pending counts the group's jobs which have not finished
+template <typename F> class group_job : public job {
+  F f_;
+  std::atomic<size_t> &pending_;
+  void run() override { f_(); }
+  void finish() override {
+    std::atomic<size_t> &pending = pending_;
+    delete this;
+    pending.fetch_sub(1, std::memory_order_release);
+  }
+
+public:
+  group_job(F f, std::atomic<size_t> &pending)
+      : f_(std::move(f)), pending_(pending) {}
+  [[nodiscard]] const void *group() const override { return &pending_; }
+};
+
+template <typename F> class function_job : public job {
+  F &f_;
+  void run() override { f_(); }
+
+public:
+  explicit function_job(F &f) : f_(f) {}
+};
+
+// a fixed size Chase-Lev deque, following "Correct and Efficient
+// Work-Stealing for Weak Memory Models" (Le et al.)
+// the owner calls push and pop, anyone can call steal
+// when it is full push fails and the caller just runs the work itself
+class work_stealing_deque {
+  static constexpr int64_t capacity = 1U << 12U;
+
+  alignas(64) std::atomic<int64_t> top_{0};
+  alignas(64) std::atomic<int64_t> bottom_{0};
+  alignas(64) std::atomic<job *> buffer_[capacity] = {};
+
+public:
+  bool push(job *j) {
+    int64_t b = bottom_.load(std::memory_order_relaxed);
+    int64_t t = top_.load(std::memory_order_acquire);
+    if (b - t >= capacity) {
+      return false;
+    }
+    buffer_[b % capacity].store(j, std::memory_order_relaxed);
+    bottom_.store(b + 1, std::memory_order_release);
+    return true;
+  }
+
+  job *pop() {
+    int64_t b = bottom_.load(std::memory_order_relaxed) - 1;
+    bottom_.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t t = top_.load(std::memory_order_relaxed);
+    if (t > b) {
+      // empty
+      bottom_.store(b + 1, std::memory_order_relaxed);
+      return nullptr;
+    }
+    job *j = buffer_[b % capacity].load(std::memory_order_relaxed);
+    if (t == b) {
+      // the last element, race the thieves for it
+      if (!top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                        std::memory_order_relaxed)) {
+        j = nullptr;
+      }
+      bottom_.store(b + 1, std::memory_order_relaxed);
+    }
+    return j;
+  }
+
+  job *steal() {
+    int64_t t = top_.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t b = bottom_.load(std::memory_order_acquire);
+    if (t >= b) {
+      return nullptr;
+    }
+    job *j = buffer_[t % capacity].load(std::memory_order_acquire);
+    if (!top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                      std::memory_order_relaxed)) {
+      return nullptr;
+    }
+    return j;
+  }
+};
+
+inline thread_local int scheduler_worker_id = -1;
+// how many stolen jobs this worker is running on top of frames which are
+// waiting in sync
+inline thread_local int scheduler_sync_depth = 0;
+
+class scheduler {
+  // how many rounds of failed steals an idle worker makes before sleeping
+  static constexpr int steal_rounds_before_sleep = 64;
+  // a worker waiting in sync stops taking other work once this many stolen
+  // jobs are already stacked on top of waiting frames
+  static constexpr int max_sync_depth = 32;
+  // waits yield this many times before they start sleeping
+  static constexpr int backoff_spins = 64;
+  static constexpr int max_backoff_us = 50;
+
+  int num_workers_;
+  std::unique_ptr<work_stealing_deque[]> deques_;
+  std::vector<std::thread> threads_;
+  std::atomic<bool> finished_{false};
+
+  // sleeping workers wait for epoch to change, it is bumped whenever there
+  // may be new work for them
+  std::mutex sleep_mutex_;
+  std::condition_variable sleep_cv_;
+  std::atomic<uint64_t> epoch_{0};
+  std::atomic<int> sleepers_{0};
+
+  static int workers_from_environment() {
+    if (const char *env = std::getenv("PT_NUM_THREADS")) {
+      int n = std::atoi(env);
+      if (n > 0) {
+        return n;
+      }
+    }
+    int n = static_cast<int>(std::thread::hardware_concurrency());
+    return (n > 0) ? n : 1;
+  }
+
+  static uint64_t next_random() {
+    thread_local uint64_t state =
+        0x9E3779B97F4A7C15ULL * (scheduler_worker_id + 1);
+    state ^= state << 13U;
+    state ^= state >> 7U;
+    state ^= state << 17U;
+    return state;
+  }
+
+  job *try_steal(int id) {
+    int victim = static_cast<int>(next_random() % num_workers_);
+    if (victim == id) {
+      return nullptr;
+    }
+    return deques_[victim].steal();
+  }
+
+  // one pass over every other worker
+  job *steal_anywhere(int id) {
+    int start = static_cast<int>(next_random() % num_workers_);
+    for (int i = 0; i < num_workers_; i++) {
+      int victim = (start + i) % num_workers_;
+      if (victim != id) {
+        if (job *j = deques_[victim].steal()) {
+          return j;
+        }
+      }
+    }
+    return nullptr;
+  }
+
+  void wake_sleepers() {
+    // pairs with the fence in sleep, either we see the sleeper or it sees
+    // the work we just pushed
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleepers_.load(std::memory_order_relaxed) > 0) {
+      epoch_.fetch_add(1, std::memory_order_seq_cst);
+      std::lock_guard<std::mutex> lock(sleep_mutex_);
+      sleep_cv_.notify_all();
+    }
+  }
+
+  // returns a job if one showed up while getting ready to sleep
+  job *sleep(int id) {
+    uint64_t epoch = epoch_.load(std::memory_order_seq_cst);
+    sleepers_.fetch_add(1, std::memory_order_seq_cst);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (job *j = steal_anywhere(id)) {
+      sleepers_.fetch_sub(1, std::memory_order_seq_cst);
+      return j;
+    }
+    {
+      std::unique_lock<std::mutex> lock(sleep_mutex_);
+      sleep_cv_.wait(lock, [&]() {
+        return epoch_.load(std::memory_order_seq_cst) != epoch ||
+               finished_.load(std::memory_order_seq_cst);
+      });
+    }
+    sleepers_.fetch_sub(1, std::memory_order_seq_cst);
+    return nullptr;
+  }
+
+  static void run_stolen(int id, job *j) {
+    j->set_thief(id);
+    j->execute();
+  }
+
+  void worker_loop(int id) {
+    scheduler_worker_id = id;
+    int failed_rounds = 0;
+    while (!finished_.load(std::memory_order_acquire)) {
+      if (job *j = deques_[id].pop()) {
+        j->execute();
+        failed_rounds = 0;
+        continue;
+      }
+      if (job *j = try_steal(id)) {
+        run_stolen(id, j);
+        failed_rounds = 0;
+        continue;
+      }
+      failed_rounds += 1;
+      if (failed_rounds < steal_rounds_before_sleep * num_workers_) {
+        std::this_thread::yield();
+        continue;
+      }
+      failed_rounds = 0;
+      if (job *found = sleep(id)) {
+        run_stolen(id, found);
+      }
+    }
+  }
+
+public:
+  scheduler()
+      : num_workers_(workers_from_environment()),
+        deques_(new work_stealing_deque[num_workers_]) {
+    scheduler_worker_id = 0;
+    threads_.reserve(num_workers_ - 1);
+    for (int i = 1; i < num_workers_; i++) {
+      threads_.emplace_back([this, i]() { worker_loop(i); });
+    }
+  }
+  ~scheduler() {
+    finished_.store(true, std::memory_order_seq_cst);
+    epoch_.fetch_add(1, std::memory_order_seq_cst);
+    {
+      std::lock_guard<std::mutex> lock(sleep_mutex_);
+      sleep_cv_.notify_all();
+    }
+    for (auto &t : threads_) {
+      t.join();
+    }
+  }
+  scheduler(const scheduler &) = delete;
+  scheduler &operator=(const scheduler &) = delete;
+
+  [[nodiscard]] int num_workers() const { return num_workers_; }
+
+  // returns false if the work could not be queued and should be run directly
+  bool spawn(int id, job *j) {
+    if (!deques_[id].push(j)) {
+      return false;
+    }
+    wake_sleepers();
+    return true;
+  }
+
+  // yields for the first rounds of a wait and then sleeps for longer and
+  // longer up to max_backoff_us
+  static void backoff(int round) {
+    if (round < backoff_spins) {
+      std::this_thread::yield();
+    } else {
+      int us = round - backoff_spins + 1;
+      if (us > max_backoff_us) {
+        us = max_backoff_us;
+      }
+      std::this_thread::sleep_for(std::chrono::microseconds(us));
+    }
+  }
+
+  // called by the worker which spawned j once it is ready to join with it
+  // either j is still on the bottom of the deque and is run here, or it was
+  // stolen and this worker helps until it is finished.  It helps by stealing
+  // from the thief of j, which is usually work from under j, but the thief's
+  // deque can also hold older work, so any stolen job can end up running on
+  // top of this frame.  To keep the stack bounded a worker stops stealing here
+  // once max_sync_depth stolen jobs are stacked on waiting frames and just
+  // waits.
+  void sync(int id, job *j) {
+    job *popped = deques_[id].pop();
+    if (popped != nullptr) {
+      // everything spawned after j has been joined already, so only j can be
+      // on the bottom of the deque
+      popped->execute();
+      return;
+    }
+    int round = 0;
+    while (!j->done()) {
+      int thief = j->thief();
+      job *other = nullptr;
+      if (thief >= 0 && scheduler_sync_depth < max_sync_depth) {
+        other = deques_[thief].steal();
+      }
+      if (other != nullptr) {
+        scheduler_sync_depth += 1;
+        run_stolen(id, other);
+        scheduler_sync_depth -= 1;
+        round = 0;
+      } else {
+        backoff(round++);
+      }
+    }
+  }
+
+  // waits until every job of the task_group counted by pending is finished
+  // the group's jobs still on the bottom of this worker's deque are run here,
+  // popping stops at a job of anything else since that is older work from
+  // further up the stack.  The rest were stolen and are waited for.
+  void wait_group(int id, const std::atomic<size_t> &pending) {
+    if (id >= 0) {
+      while (pending.load(std::memory_order_acquire) > 0) {
+        job *j = deques_[id].pop();
+        if (j == nullptr) {
+          break;
+        }
+        if (j->group() != &pending) {
+          deques_[id].push(j);
+          break;
+        }
+        j->execute();
+      }
+    }
+    int round = 0;
+    while (pending.load(std::memory_order_acquire) > 0) {
+      backoff(round++);
+    }
+  }
+};
+
+inline scheduler &get_scheduler() {
+  static scheduler s;
+  return s;
+}
+
+template <typename Lf, typename Rf>
+inline void scheduler_par_do(Lf &left, Rf &right) {
+  scheduler &s = get_scheduler();
+  int id = scheduler_worker_id;
+  if (id < 0 || s.num_workers() == 1) {
+    right();
+    left();
+    return;
+  }
+  function_job<Rf> right_job(right);
+  if (!s.spawn(id, &right_job)) {
+    right();
+    left();
+    return;
+  }
+  left();
+  s.sync(id, &right_job);
+}
+
+// runs f on [start, end) in blocks of chunksize which start at multiples of
+// chunksize from start, the blocks are split in half recursively
+template <typename F>
+inline void scheduler_parallel_for(size_t start, size_t end, F &f,
+                                   size_t chunksize) {
+  size_t num_chunks = (end - start + chunksize - 1) / chunksize;
+  if (num_chunks <= 1) {
+    for (size_t i = start; i < end; i++) {
+      f(i);
+    }
+    return;
+  }
+  size_t mid = start + (num_chunks / 2) * chunksize;
+  auto left = [&]() { scheduler_parallel_for(start, mid, f, chunksize); };
+  auto right = [&]() { scheduler_parallel_for(mid, end, f, chunksize); };
+  scheduler_par_do(left, right);
+}
+
+// the same default grain size cilk_for uses
+inline size_t scheduler_default_grain(size_t n) {
+  size_t grain = n / (8 * static_cast<size_t>(get_scheduler().num_workers()));
+  if (grain > 2048) {
+    grain = 2048;
+  }
+  return (grain == 0) ? 1 : grain;
+}
+
+} // namespace detail
+
+} // namespace ParallelTools